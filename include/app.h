@@ -21,6 +21,7 @@
 #define APP_H
 
 #include "alsamidi.h"
+#include "jackmidi.h"
 #include "audio_driver.h"
 #include "nsmclient.h"
 #include <QObject>
@@ -46,6 +47,7 @@ signals:
 private:
     NSMClient nsmClient;
     AlsaMidiDriver midiDriver;
+    JackMidiDriver jackMidiDriver;
     JackAudioDriver jackDriver;
     QString fileLocation;
 
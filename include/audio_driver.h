@@ -26,52 +26,54 @@
 #include <string>
 #include <map>
 
+#include <pthread.h>
 #include <jack/jack.h>
 
 using namespace std;
 
+#include "worker.h"
+
 /** A list of buffers */
 typedef vector<float*> BufferList;
 
+/** A handle to a port registered with an AudioDriver: an index into the
+	driver's port table. Stays valid until the port is unregistered. */
+typedef int PortHandle;
+
 /** A request for a buffer, and application-supplied information about what to do with it */
 struct BufferRequest {
 public:
-	typedef std::vector<string> PortNameList;
-
-	BufferRequest(void* data)
-	: data(data)
-	{}
-
-	BufferRequest(void* data, PortNameList portNames)
+	BufferRequest(void* data, PortHandle left, PortHandle right)
 	: data(data)
-	, portNames(portNames)
+	, left(left)
+	, right(right)
 	{}
 
-	PortNameList& getPortNames() { return portNames; }
+	PortHandle getLeftPort() { return left; }
+	PortHandle getRightPort() { return right; }
 
 	void* getData() { return data; }
 
 private:
 	void* data;
-	PortNameList portNames;
+	PortHandle left, right;
 };
 
-typedef std::vector<BufferRequest*> BufferRequestList;
+/** The buffer requests for one period. The driver reserves room for
+	MAX_BUFFER_REQUESTS of them up front, so filling it doesn't allocate. */
+typedef std::vector<BufferRequest> BufferRequestList;
 
 /** A response to a buffer request */
 struct BufferResponse {
-	typedef std::map<string, void*> BufferMap;
-
 	BufferResponse(BufferRequest* req, unsigned frames)
 	: request(req)
 	, frames(frames)
+	, left(0)
+	, right(0)
 	{}
 
-	virtual ~BufferResponse();
-
 	unsigned getFrames() { return frames; }
 	BufferRequest* getRequest() { return request; }
-	BufferMap& getBufferMap() { return buffers; }
 
 	float* getLeft() { return left; }
 	BufferResponse& setLeft(float* buf) { left = buf; return *this; }
@@ -79,27 +81,31 @@ struct BufferResponse {
 	float* getRight() { return right; }
 	BufferResponse& setRight(float* buf) { right = buf; return *this; }
 
-	BufferResponse& add(string& portName, void* buffer)
-	{
-		buffers[portName] = buffer;
-		return *this;
-	}
-
 private:
 	BufferRequest* request;
 	unsigned frames;
-	BufferMap buffers;
 	float* left;
 	float* right;
 };
 
 
-/** A listener to audio events. */
+/** A listener to audio events.
+	All calls are made on the process thread (or its helpers), once per period,
+	so they must not allocate memory, block, or do I/O. */
 struct IAudioListener {
 	virtual ~IAudioListener() {}
 
-	virtual BufferRequestList getBufferRequests() = 0;
+	/// Add a request to "requests" for each buffer we want to fill this period,
+	/// which is "frames" frames long.
+	virtual void getBufferRequests(BufferRequestList& requests, unsigned frames) = 0;
 	virtual void play(BufferResponse* response) = 0;
+
+	/** Whether play() can be called for several of our requests at once, on
+		different threads. Only say yes if no two requests touch the same state. */
+	virtual bool playsInParallel() { return false; }
+
+	/// Called once all of this period's responses have been played.
+	virtual void playDone() {}
 };
 
 typedef std::vector<IAudioListener*> AudioListenerList;
@@ -110,7 +116,7 @@ class AudioDriver
 public:
 	typedef std::vector<string> ClientNameList;
 
-    AudioDriver() : sampleRate(44100)
+    AudioDriver() : sampleRate(44100), bufferSize(0)
 	{}
 
 	virtual ~AudioDriver() {}
@@ -120,23 +126,47 @@ public:
 	virtual ClientNameList getClientNames() = 0;
 
 	int getSampleRate() { return sampleRate; }
+	/// Frames per period.
+	int getBufferSize() { return bufferSize; }
 	void addAudioListener(IAudioListener* listener) { listeners.push_back(listener); }
 
-	virtual bool registerPort(string &port) = 0;
-	virtual bool unregisterPort(string & portName) = 0;
-	virtual bool hasRegisteredPort(string &port) = 0;
+	/// Register an output port. Returns its handle, or NO_PORT if that didn't work.
+	virtual PortHandle registerPort(string &port) = 0;
+	/** Unregister a port. Its handle is free straight away, but the port itself
+		may live on until the process thread is done with it. */
+	virtual bool unregisterPort(PortHandle port) = 0;
+	/// Return the handle of the named port, or NO_PORT if it isn't registered.
+	virtual PortHandle findPort(string &port) = 0;
+
+	/// The current time, in frames. Callable from any thread.
+	virtual unsigned getFrameTime() = 0;
+	/// The time, in frames, at which the current period started. Process thread only.
+	virtual unsigned getPeriodStartTime() = 0;
+	/// Whether the caller is on the process thread (where the listeners are called).
+	virtual bool isProcessThread() = 0;
 
 	string & getClientName() { return clientName; }
 
 	static const char* LEFT_PORT_NAME;
 	static const char* RIGHT_PORT_NAME;
 
+	/// How many buffer requests the listeners can make per period without allocating.
+	static const unsigned MAX_BUFFER_REQUESTS = 128;
+
+	/// The size of the port table.
+	static const unsigned MAX_PORTS = 256;
+
+	static const PortHandle NO_PORT = -1;
+	static const PortHandle LEFT_PORT = 0;
+	static const PortHandle RIGHT_PORT = 1;
+
 	virtual bool connectPort(string & portName, string & target) = 0;
 	virtual bool connectMainStereoOut(string &leftPortName, string &rightPortName) = 0;
 
 protected:
 	string clientName;
 	int sampleRate;
+	int bufferSize;
 	AudioListenerList listeners;
 };
 
@@ -144,20 +174,30 @@ protected:
 class JackAudioDriver: public AudioDriver
 {
 public:
-	typedef std::map<string, jack_port_t*> JackPortMap;
+	typedef jack_default_audio_sample_t sample_t;
+	typedef std::map<string, PortHandle> PortHandleMap;
 
+	JackAudioDriver();
 	virtual ~JackAudioDriver();
 
     virtual bool open(string &clientName);
 	virtual void close();
-	virtual bool registerPort(string &port);
-	virtual bool unregisterPort(string & portName);
-	virtual bool hasRegisteredPort(string &port);
+	virtual PortHandle registerPort(string &port);
+	virtual bool unregisterPort(PortHandle port);
+	virtual PortHandle findPort(string &port);
+	virtual unsigned getFrameTime();
+	virtual unsigned getPeriodStartTime();
+	virtual bool isProcessThread();
 	virtual ClientNameList getClientNames();
 
 	virtual bool connectPort(string &portName, string &target);
 	virtual bool connectMainStereoOut(string &leftPortName, string &rightPortName);
 
+	/** How many helper threads render buffers alongside the process thread.
+		-1 (the default) means one for each extra CPU. Takes effect on open(). */
+	void setRenderThreads(int threads) { renderThreads = threads; }
+	unsigned getRenderThreads() { return workers.getThreadCount(); }
+
 	virtual void onJackShutdown();
 	virtual void onJackSampleRateChange(jack_nframes_t);
 	virtual void onJackBufferSize(jack_nframes_t);
@@ -173,8 +213,27 @@ public:
 	void process(jack_nframes_t frames);
 
 protected:
-	jack_port_t *right, *left;
-	JackPortMap portMap;
+	/** A port taken out of the table, waiting for the process thread to finish
+		the period that might still be using it. */
+	struct RetiredPort {
+		jack_port_t *port;
+		unsigned cycle;		///< "cycles" when it came out of the table.
+	};
+	typedef std::vector<RetiredPort> RetiredPortList;
+
+	/// Unregister the retired ports the process thread is done with (all of them, if "all"). Call with portLock held.
+	void reapPorts(bool all);
+
+	jack_port_t *ports[MAX_PORTS];	///< Indexed by PortHandle.
+	sample_t *buffers[MAX_PORTS];	///< Each port's buffer for the current period.
+	unsigned portCount;				///< One past the highest handle in use.
+	PortHandleMap portHandles;		///< Handles by port name. Not for the process thread.
+	RetiredPortList retiredPorts;
+	unsigned cycles;				///< Periods process() has finished.
+	pthread_mutex_t portLock;		///< Guards portHandles, retiredPorts and port registration.
+	BufferRequestList requests;
+	int renderThreads;
+	WorkerPool workers;
 };
 
 #endif // audio_driver_h
@@ -26,11 +26,18 @@ struct IFileLoadProgressListener {
 	virtual bool progressEvent(string &) { return true; }
 };
 
+class SampleLoader;
+class KitCache;
+
 // Layer configuration info
 struct LayerInfo
 {
+	typedef std::vector<std::string> WaveList;
+
 	std::string lo, hi;
-	std::string wave;
+	WaveList waves;			///< One or more takes.
+	std::string select;		///< "roundrobin" (the default) or "random"
+	std::string seed;		///< For "random"
 	
 	static LayerInfo* from(InstrumentLayer *layer);
 };
@@ -53,8 +60,14 @@ struct InstrumentInfo
 	std::string level;
 	std::string pan;
 	std::string pitch;
-
-	Instrument* toInstrument(int maxSamples = -1, IFileLoadProgressListener * = 0);
+	std::string crossfade;	///< Width of the crossfade zones between layers, if any.
+	std::string interpolation;	///< "linear", "cubic" (the default) or "sinc"
+	std::string polyphony;	///< Most voices at once, if limited.
+	std::string steal;		///< "oldest" (the default), "quietest" or "same-note"
+	std::string release;	///< Milliseconds a choked voice takes to fade out.
+
+	// Samples come from "loader" if there is one, or are loaded as we go.
+	Instrument* toInstrument(int maxSamples = -1, IFileLoadProgressListener * = 0, SampleLoader * loader = 0);
 	static InstrumentInfo* from(Instrument*);
 };
 
@@ -97,7 +110,7 @@ struct SceneInfo
 // Kit configuration info
 struct KitInfo
 {
-	KitInfo() {}
+	KitInfo() : limiter(false), polyphony(0) {}
 	~KitInfo();
 	
 	typedef std::vector<InstrumentInfo*> InstrumentInfoList;
@@ -106,6 +119,9 @@ struct KitInfo
 
 	string name;
 	unsigned level;
+	bool limiter;
+	unsigned polyphony;		///< Most voices at once for the whole kit; 0 for no limit.
+	std::string steal;		///< As for InstrumentInfo.
 	InstrumentInfoList instruments;
 	SceneInfoList scenes;
 	string selectedScene;
@@ -133,8 +149,8 @@ public:
 
 	/// Load a configuration file.
 	bool load(const char *, IFileLoadProgressListener * = 0);
-	/// Load the configuration file into the specified drumkit.
-	bool load(const char *, Drumkit *kit, bool ignorePorts = false, int maxSamples = -1, IFileLoadProgressListener * = 0);
+	/// Load the configuration file into the specified drumkit, from its compiled copy where that's up to date.
+	bool load(const char *, Drumkit *kit, bool ignorePorts = false, int maxSamples = -1, IFileLoadProgressListener * = 0, KitCache * = 0);
 
 	/// Save the configuration in a file.
 	bool save(const char *);
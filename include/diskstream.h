@@ -0,0 +1,148 @@
+// diskstream.h
+// streams the tails of long samples from disk, for libraries too big to keep in memory
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef diskstream_h
+#define diskstream_h
+
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+class Sample;
+
+/** Plays long samples without holding all of them in memory.
+
+	With a preload set, only the first few milliseconds of each long sample are
+	loaded; Sample::totalFrames says how long it really is. When a voice starts
+	one, it opens a stream: a ring buffer that an I/O thread fills from the wave
+	file, starting just before the end of the part in memory. By the time the
+	voice has played through what's in memory, the stream should be well ahead
+	of it.
+
+	The audio thread never waits on the stream. If the frames a voice needs
+	haven't been read yet, it plays silence for that stretch (keeping time, so
+	it picks up in the right place) and the underrun is counted.
+
+	Each ring holds RING_FRAMES frames, and the first MIRROR_FRAMES of them are
+	written a second time just past the end, so any run of up to MIRROR_FRAMES
+	frames can be read in one piece, wherever it starts.
+	*/
+class DiskStreamer {
+public:
+	enum {
+		MAX_STREAMS = 64,		///< Streamed voices playing at once.
+		RING_FRAMES = 32768,	///< Must be a power of 2.
+		MIRROR_FRAMES = 4096,
+		CHUNK_FRAMES = 4096,	///< Read from the file this many frames at a time.
+		TAPS = 4,				///< The most frames an interpolator reads either side of a position.
+		MIN_PRELOAD_FRAMES = 64
+	};
+
+	DiskStreamer();
+	~DiskStreamer();
+
+	/** Keep just the first "ms" milliseconds of each sample in memory, and
+		stream the rest. 0 (the default) keeps whole samples in memory.
+		Set it before loading a kit. */
+	static void setPreload(unsigned ms) { preload = ms; }
+	static unsigned getPreload() { return preload; }
+	static bool isEnabled() { return preload > 0; }
+
+	/// How many frames of a sample at "rate" stay in memory.
+	static unsigned preloadFrames(unsigned rate);
+
+	/** Where a voice stops playing from memory and starts on its stream: far
+		enough short of the end of what's in memory that an interpolator never
+		reads past it. */
+	static unsigned seamFor(unsigned resident) { return resident - TAPS - 1; }
+
+	/** Start the I/O thread. Does nothing if it's already running. */
+	bool start();
+	void stop();
+	bool isRunning() const { return __atomic_load_n(&running, __ATOMIC_ACQUIRE); }
+
+	// The rest is for the audio thread; none of it blocks.
+
+	/** Open a stream for the part of "sample" that isn't in memory. Returns
+		the stream, or -1 if every stream is busy. */
+	int open(const Sample *sample);
+
+	/** Close a stream. It's free again once the I/O thread has let go of it. */
+	void close(int stream);
+
+	/** Point left/right at "count" frames of the stream, starting at frame
+		"first" of the sample. "count" mustn't be more than MIRROR_FRAMES.
+		False (and an underrun is counted) if they haven't been read yet. */
+	bool read(int stream, unsigned first, unsigned count, const float *&left, const float *&right);
+
+	/** The voice has got to "frame" of the sample. It won't read more than
+		TAPS frames behind that again, so the I/O thread can fill in over them. */
+	void release(int stream, unsigned frame);
+
+	/** Have the I/O thread top the streams up. Called once a period. */
+	void wake();
+
+	/// How many times a voice wanted frames that weren't there yet.
+	unsigned getUnderruns() const;
+
+private:
+	enum State {
+		IDLE,		///< Free for the audio thread to open.
+		OPENING,	///< Opened by the audio thread; the I/O thread will start reading.
+		PLAYING,	///< Being filled by the I/O thread.
+		CLOSING		///< Closed by the audio thread; the I/O thread will let it go.
+	};
+
+	struct Stream {
+		int state;
+		char path[PATH_MAX];
+		unsigned start;		///< The frame of the sample at the start of the stream.
+		unsigned end;		///< The frame of the sample where it ends.
+		unsigned written;	///< Frames the I/O thread has put in the ring, counting from "start".
+		unsigned consumed;	///< Frames the voice is done with, counting from "start".
+		float *left;
+		float *right;
+		void *file;			///< The SNDFILE; the I/O thread's business.
+		bool opened;		///< The I/O thread has tried to open the file.
+		unsigned channels;
+	};
+
+	static void* threadMain(void *arg);
+	void run();
+	bool fill(Stream &stream);
+	void closeFile(Stream &stream);
+
+	static unsigned preload;
+
+	Stream *streams;
+	float *buffer;			///< Interleaved frames as they come off the disk.
+	unsigned bufferChannels;
+	pthread_t thread;
+	sem_t wakeup;
+	bool running;
+	bool quit;
+	unsigned underruns;
+
+	DiskStreamer(const DiskStreamer &);
+	DiskStreamer & operator = (const DiskStreamer &);
+};
+
+#endif // diskstream_h
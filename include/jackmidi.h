@@ -0,0 +1,58 @@
+// jackmidi.h
+// midi input through a Jack midi port
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef jackmidi_h
+#define jackmidi_h
+
+#include <jack/jack.h>
+#include "midi.h"
+#include "audio_driver.h"
+
+/** A MIDI driver that reads a Jack MIDI input port.
+
+	Events are read on the Jack process thread, at the start of each period,
+	and handed to the listeners with their frame offset into the period
+	(MidiMessage::frame), so voices can start on the exact frame.
+	To get events to SDDM in the same period they arrive, add this driver to
+	the JackAudioDriver as an audio listener ahead of SDDM.
+	*/
+class JackMidiDriver : public MidiDriver, public IAudioListener
+{
+public:
+	JackMidiDriver();
+	virtual ~JackMidiDriver();
+
+	virtual void open(string &clientName);
+	virtual void close();
+	virtual PortList getOutputPortList();
+	virtual void connectPort(string &port, string &target);
+
+	// IAudioListener. We don't want any buffers; this is just our hook into the period.
+	virtual void getBufferRequests(BufferRequestList& requests, unsigned frames);
+	virtual void play(BufferResponse*) {}
+
+	static const char* PORT_NAME;
+
+private:
+	jack_port_t *input;
+};
+
+#endif // jackmidi_h
@@ -0,0 +1,139 @@
+// kitcache.h
+// a compiled copy of a kit (.sddmkit) that loads without parsing or decoding anything
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef kitcache_h
+#define kitcache_h
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+class Sample;
+class Drumkit;
+class Configuration;
+
+/** The compiled form of a kit file. Compiled kits live in the sample store's
+	directory, if there is one (see SampleStore), or else in the user's cache
+	directory, named after the kit file's full path.
+
+	A compiled kit holds the kit's configuration, already parsed, and every wave
+	it uses, already decoded into planar 32-bit float. Each wave starts on a page
+	of its own, so take() can map it straight into a Sample without copying it.
+
+	The cache is tied to the size, modification time and contents of the kit
+	file, and to the size and modification time of every wave, and carries a hash
+	of its own metadata. If any of that doesn't match, the cache is stale: the kit
+	is loaded the slow way, and written again. Each wave's data is hashed too, but
+	only checked when verifying is turned on, since that means reading every page.
+	*/
+class KitCache {
+public:
+	KitCache(const std::string &kitFile, int maxSamples = -1);
+	~KitCache();
+
+	/// Where the compiled copy of "kitFile" lives. Empty if there's nowhere to put it.
+	static std::string pathFor(const std::string &kitFile);
+
+	/** Check each wave's data against its hash as it's taken. Off by default. */
+	static void setVerify(bool v) { verify = v; }
+	static bool isVerifying() { return verify; }
+
+	/** Open the compiled kit. False (and the cache is stale) if there isn't
+		one, or it's out of date. */
+	bool open();
+
+	/// True until open() succeeds, or if a wave turned out to be damaged.
+	bool isStale() const { return stale; }
+
+	/** Fill in the ports and kit configuration that were compiled. */
+	bool read(Configuration &conf);
+
+	/** The compiled copy of a wave, mapped into a new Sample, or null if it
+		isn't in the cache (or doesn't check out). */
+	Sample* take(const std::string &filename);
+
+	/** Compile the kit from its configuration (which must be the whole kit, not
+		filtered down to some submixes) and the samples it was loaded with. */
+	bool write(Configuration &conf, Drumkit &drumkit);
+
+	/** The same, on a thread of its own, so the load doesn't wait for it.
+		Everything it needs is taken from "conf" and "drumkit" before it returns.
+		False if there's nowhere to write it, or another kit is still being
+		written. */
+	bool writeLater(Configuration &conf, Drumkit &drumkit);
+
+	/// Wait for whatever writeLater started to finish.
+	static void waitForWrites();
+
+private:
+	struct Entry {
+		uint64_t offset;
+		uint64_t length;
+		uint64_t left;			///< Relative to "offset".
+		uint64_t right;
+		uint64_t hash;
+		uint32_t frames;
+		uint32_t sampleRate;
+	};
+
+	typedef std::map<std::string, Entry> EntryMap;
+
+	/** What writing a kit takes, copied out of the loaded kit. The samples are
+		held in the SampleRegistry until it's written. */
+	struct Job {
+		std::string kitFile;
+		std::string cacheFile;
+		int maxSamples;
+		uint64_t kitSize;
+		int64_t kitModified;
+		int64_t kitModifiedNanos;
+		uint64_t kitHash;
+		std::string config;
+		std::vector<const Sample*> samples;
+		std::vector<std::string> paths;		///< Canonical, which is what take() looks for.
+	};
+
+	Job* prepare(Configuration &conf, Drumkit &drumkit);
+	static bool run(Job &job);
+	static void finish(Job *job);
+	static void* writerMain(void *arg);
+
+	static bool verify;
+	static pthread_mutex_t writerLock;
+	static pthread_t writer;
+	static bool writerStarted;		///< "writer" is yet to be joined.
+	static bool writerBusy;
+
+	std::string kitFile;
+	std::string cacheFile;
+	int maxSamples;
+	int fd;
+	bool stale;
+	std::string config;			///< The compiled configuration, still serialized.
+	EntryMap entries;
+
+	KitCache(const KitCache&);
+	KitCache& operator=(const KitCache&);
+};
+
+#endif // kitcache_h
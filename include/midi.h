@@ -51,12 +51,16 @@ public:
 	int data1;
 	int data2;
 	int channel;
+	int frame;		///< Frame offset into the current audio period, or -1 if unknown.
+	int age;		///< How long ago the event came in, in microseconds, or -1 if unknown.
 
 	MidiMessage()
 		: type(UNKNOWN)
 		, data1(-1)
 		, data2(-1)
 		, channel(-1)
+		, frame(-1)
+		, age(-1)
 	{}
 };
 
@@ -0,0 +1,97 @@
+// mixer.h
+// mix-add and soft-clip kernels for rendering notes into Jack buffers
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef mixer_h
+#define mixer_h
+
+#include <stdint.h>
+
+/** A position in a sample, in frames, as 32.32 fixed point: whole frames in the
+	top 32 bits, the fraction in the bottom 32. Unlike a float, it's exact no
+	matter how far into a long sample we get. */
+typedef uint64_t SamplePosition;
+
+const unsigned POSITION_FRACTION_BITS = 32;
+const SamplePosition POSITION_ONE = (SamplePosition)1 << POSITION_FRACTION_BITS;
+const SamplePosition POSITION_FRACTION_MASK = POSITION_ONE - 1;
+
+/** Where the soft clipper starts to bend. Below it, audio passes through untouched;
+	above it, it's squashed smoothly towards (but never past) full scale. */
+const float CLIP_KNEE = 0.9f;
+
+/** Mix-add kernels for unpitched notes, and the soft clipper for finished buses.
+
+	An unpitched note steps through its sample one frame at a time, so mixing it
+	is a plain gain-multiply-accumulate of the sample data into the output buffers.
+	The best kernels for the CPU we're running on (AVX, SSE2, NEON or plain C++)
+	are picked once at startup.
+	*/
+class Mixer {
+public:
+	typedef void (*MixFunction)(
+		float *left, float *right
+	, const float *sampleL, const float *sampleR
+	, unsigned frames
+	, float gainL, float gainR
+	, float &peakL, float &peakR);
+
+	/** Mix "frames" frames of sample data into left/right, scaled by gainL/gainR.
+		peakL/peakR are raised to the loudest (absolute) contribution mixed in. */
+	static void mix(
+		float *left, float *right
+	, const float *sampleL, const float *sampleR
+	, unsigned frames
+	, float gainL, float gainR
+	, float &peakL, float &peakR)
+	{
+		kernel(left, right, sampleL, sampleR, frames, gainL, gainR, peakL, peakR);
+	}
+
+	typedef void (*ClipFunction)(float *buffer, unsigned frames);
+
+	/** Soft-clip "frames" samples of a mixed bus in place, so the bus never goes
+		past full scale. Anything under CLIP_KNEE comes out unchanged. */
+	static void clip(float *buffer, unsigned frames)
+	{
+		clipKernel(buffer, frames);
+	}
+
+	/// The name of the kernel in use ("avx", "sse2", "neon" or "scalar").
+	static const char *getKernelName() { return kernelName; }
+
+	/// The portable kernel. Always available.
+	static void mixScalar(
+		float *left, float *right
+	, const float *sampleL, const float *sampleR
+	, unsigned frames
+	, float gainL, float gainR
+	, float &peakL, float &peakR);
+
+	/// The portable soft clipper. Always available.
+	static void clipScalar(float *buffer, unsigned frames);
+
+private:
+	static MixFunction kernel;
+	static ClipFunction clipKernel;
+	static const char *kernelName;
+};
+
+#endif // mixer_h
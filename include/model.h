@@ -26,8 +26,10 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <stdint.h>
 
 #include "scene.h"
+#include "outputstage.h"
 
 using namespace std;
 
@@ -40,11 +42,19 @@ typedef vector<std::string> StringList;
 class Sample {
 private:
 	std::string filename;
+	void *mapping;			///< Where dataL/dataR live, if they came out of the SampleStore.
+	size_t mappingLength;
+
+	friend class SampleStore;
+	friend class KitCache;
 
 public:
 	Sample(unsigned frames, const string& filename);
 	Sample(const char *filename)
 	: filename(filename)
+	, mapping(0)
+	, mappingLength(0)
+	, totalFrames(0)
 	{}
 
 	virtual ~Sample();
@@ -54,14 +64,21 @@ public:
 public:
 	float *dataL;
 	float *dataR;
-	unsigned frames;
+	unsigned frames;		///< How many frames are in dataL/dataR.
+	unsigned totalFrames;	///< How long the sample really is; more than "frames" if the rest is streamed.
 	unsigned sampleRate;
 
 	/// Returns the bytes number ( 2 channels )
 	unsigned getLength() const {	return frames * sizeof(float) * STEREO;	}
 	unsigned getRate() const { return sampleRate; }
 
-	/// Loads a sample from disk
+	/// True if the data is mapped straight from the SampleStore.
+	bool isMapped() const { return mapping != 0; }
+
+	/// True if only the start of the sample is in memory, and the DiskStreamer plays the rest.
+	bool isStreamed() const { return totalFrames > frames; }
+
+	/// Loads a sample from disk (or the SampleStore, if it's on)
 	static Sample* load(const string& filename, int maxSamples = -1);
 
 private:
@@ -71,23 +88,58 @@ private:
 
 ostream &operator << (ostream&, Sample&);
 
+/** A list of Samples. */
+typedef std::vector<Sample*> SampleList;
+
 // A layer appearing in an instrument.
+// A layer can hold several samples (takes) of the same hit. Each note plays one
+// of them, in turn or at random, so that repeated hits don't all sound alike.
 class InstrumentLayer {
+public:
+	enum Selection {
+		ROUND_ROBIN,
+		RANDOM
+	};
+
 private:
-	Sample *sample;
+	SampleList samples;
 	unsigned velocityLO, velocityHI;
+	Selection selection;
+	unsigned seed;		///< What the random generator starts from.
+	unsigned state;		///< The random generator.
+	unsigned next;		///< The next sample, for round robin.
+	unsigned last;		///< The sample picked last time.
 
 public:
 	InstrumentLayer(Sample *sample, unsigned lo, unsigned hi)
-	: sample(sample)
-	, velocityLO(lo)
+	: velocityLO(lo)
 	, velocityHI(hi)
-	{}
+	, selection(ROUND_ROBIN)
+	, seed(1)
+	, state(1)
+	, next(0)
+	, last(0)
+	{
+		samples.push_back(sample);
+	}
 
 	virtual ~InstrumentLayer();
 
-	// Return the sample for this instrument layer.
-	const Sample* getSample() const { return sample; }
+	// Return the (first) sample for this instrument layer.
+	const Sample* getSample() const { return samples.empty() ? 0 : samples[0]; }
+
+	const SampleList& getSamples() const { return samples; }
+	InstrumentLayer& add(Sample *sample) { samples.push_back(sample); return *this; }
+
+	Selection getSelection() { return selection; }
+	InstrumentLayer& setSelection(Selection s) { selection = s; return *this; }
+
+	unsigned getSeed() { return seed; }
+	InstrumentLayer& setSeed(unsigned s) { seed = state = (s ? s : 1); return *this; }
+
+	/** Pick the sample for the next hit.
+		Only the audio thread calls this, so the selection state needs no lock. */
+	const Sample* selectSample();
 
 	unsigned getVelocityLO() { return velocityLO; }
 	InstrumentLayer& setVelocityLO(unsigned lo) { velocityLO = lo; return *this; }
@@ -108,20 +160,31 @@ class Submix {
 	string name;
 	bool autoConnect;
 	bool orphaned;
+	PortNameList ports;
+	int leftPort, rightPort;
+	OutputStage output;
 public:
 	Submix(string name)
 	: name(name)
 	, autoConnect(true)
-	{}
-	
-	PortNameList getPortNames() 
+	, orphaned(false)
+	, leftPort(-1)
+	, rightPort(-1)
 	{
-		PortNameList ports;
 		ports.push_back(name + "_L");
 		ports.push_back(name + "_R");
-		return ports;
 	}
 	
+	const PortNameList& getPortNames() { return ports; }
+
+	// Handles of the audio driver ports this submix plays into (-1 if none).
+	int getLeftPort() { return leftPort; }
+	int getRightPort() { return rightPort; }
+	void setPorts(int left, int right) { leftPort = left; rightPort = right; }
+
+	// The limiter/clipper this submix goes through. Only the audio thread touches it.
+	OutputStage& getOutputStage() { return output; }
+	
 	string& getName() { return name; }
 	bool isAutoConnect() { return autoConnect; }
 	bool isOrphan() { return orphaned; }
@@ -136,9 +199,28 @@ typedef std::vector<Instrument*> InstrumentList;
 
 /** An instrument. */
 class Instrument {
+public:
+	static const unsigned MIDI_VELOCITIES = 128;
+	static const unsigned DEFAULT_RELEASE = 10;
+
+	/// How a pitched voice reads its sample between frames.
+	enum Interpolation {
+		LINEAR,
+		CUBIC,
+		SINC
+	};
+
+	/// Which voice gives way when there are too many playing.
+	enum Stealing {
+		OLDEST,
+		QUIETEST,
+		SAME_NOTE	///< One playing the same note, or failing that the oldest.
+	};
+
 private:
 	std::string name;
 	InstrumentLayerList layers;
+	InstrumentLayer *velocityTable[MIDI_VELOCITIES];	///< The layer each velocity plays, or null.
 	InstrumentList victims;
 	unsigned noteNumber;
 	unsigned level;
@@ -148,6 +230,16 @@ private:
 	int pitch;
 	float volumeL, volumeR;
 	bool muted, autoMuted, soloed;
+	Interpolation interpolation;
+	unsigned crossfade;									///< Width of the crossfade zones between layers, in velocity steps.
+	unsigned polyphony;									///< Most voices it can play at once; 0 for no limit.
+	Stealing stealing;
+	uint32_t chokeGroup;								///< The choke group its voices belong to, as a bit; 0 for none.
+	uint32_t chokes;									///< The choke groups a hit on it silences.
+	unsigned release;									///< Milliseconds a choked voice takes to fade out.
+	float layerGain[MIDI_VELOCITIES];					///< Gain of velocityTable's layer.
+	InstrumentLayer *fadeTable[MIDI_VELOCITIES];		///< The neighbouring layer faded in, or null.
+	float fadeGain[MIDI_VELOCITIES];					///< Gain of fadeTable's layer.
 public:
 	Instrument(const char *name)
 	: name(name)
@@ -161,7 +253,14 @@ public:
 	, muted(false)
 	, autoMuted(false)
 	, soloed(false)
-	{}
+	, interpolation(CUBIC)
+	, crossfade(0)
+	, polyphony(0)
+	, stealing(OLDEST)
+	, chokeGroup(0)
+	, chokes(0)
+	, release(DEFAULT_RELEASE)
+	{ clearVelocityTable(); }
 	
 	Instrument(const char* name, const char* submix)
 	: name(name)
@@ -175,7 +274,14 @@ public:
 	, muted(false)
 	, autoMuted(false)
 	, soloed(false)
-	{}
+	, interpolation(CUBIC)
+	, crossfade(0)
+	, polyphony(0)
+	, stealing(OLDEST)
+	, chokeGroup(0)
+	, chokes(0)
+	, release(DEFAULT_RELEASE)
+	{ clearVelocityTable(); }
 
 	virtual ~Instrument();
 	
@@ -218,6 +324,16 @@ public:
 	
 	int getPitch() { return pitch; }
 	Instrument& setPitch(int pitch) { this->pitch = pitch; return *this; }
+
+	Interpolation getInterpolation() { return interpolation; }
+	Instrument& setInterpolation(Interpolation i) { interpolation = i; return *this; }
+
+	/** How many voices the instrument can play at once (0 for as many as the kit
+		allows), and which one gives way to a new hit when they're all in use. */
+	unsigned getPolyphony() { return polyphony; }
+	Instrument& setPolyphony(unsigned p) { polyphony = p; return *this; }
+	Stealing getStealing() { return stealing; }
+	Instrument& setStealing(Stealing s) { stealing = s; return *this; }
 	
 	string& getSubmixName() { return submixName; }
 	Instrument& setSubmixName(string& name) { submixName = name; return *this; }
@@ -236,61 +352,53 @@ public:
 	InstrumentList& getVictims() { return victims; }
 	bool hasVictims() { return !victims.empty(); }
 
-	Instrument &add(InstrumentLayer* layer)
+	/** Choke groups, worked out from the victims by Drumkit::buildChokeGroups().
+		Each victim gets a group (a bit) of its own, which its voices carry; a hit
+		on an instrument fades out every voice in the groups of its "chokes". */
+	uint32_t getChokeGroup() { return chokeGroup; }
+	Instrument& setChokeGroup(uint32_t group) { chokeGroup = group; return *this; }
+	uint32_t getChokes() { return chokes; }
+	Instrument& setChokes(uint32_t groups) { chokes = groups; return *this; }
+
+	/// How long a choked voice takes to fade out, in milliseconds. 0 cuts it off dead.
+	unsigned getRelease() { return release; }
+	Instrument& setRelease(unsigned ms) { release = ms; return *this; }
+
+	Instrument &add(InstrumentLayer* layer);
+
+	/// The layer for a velocity, or null. Just an array lookup.
+	InstrumentLayer* findLayerByVelocity(unsigned int velocity)
 	{
-		layers.push_back(layer);
-		return *this;
+		return (velocity < MIDI_VELOCITIES) ? velocityTable[velocity] : 0;
 	}
 
-	InstrumentLayer* findLayerByVelocity(unsigned int velocity);
+	/// How loud findLayerByVelocity's layer plays at a velocity. Less than 1 in a crossfade.
+	float getLayerGain(unsigned velocity) { return (velocity < MIDI_VELOCITIES) ? layerGain[velocity] : 1.0f; }
+
+	/// The layer being crossfaded in at a velocity, or null if there isn't one.
+	InstrumentLayer* findFadeLayerByVelocity(unsigned velocity) { return (velocity < MIDI_VELOCITIES) ? fadeTable[velocity] : 0; }
+	float getFadeGain(unsigned velocity) { return (velocity < MIDI_VELOCITIES) ? fadeGain[velocity] : 0.0f; }
+
+	/** Crossfade adjacent layers over "width" velocity steps, centred on where
+		one layer ends and the next begins. 0 (the default) switches layers hard. */
+	unsigned getCrossfade() { return crossfade; }
+	Instrument& setCrossfade(unsigned width);
+
+	/** Describe the velocities (1-127) that no layer covers, and the ones more than
+		one layer covers, as ranges like "1-19". */
+	void checkVelocityRanges(StringList& gaps, StringList& overlaps);
 
 	bool operator < (Instrument *other) const
 	{
 		return noteNumber < other->getNoteNumber();
 	}
-};
-
-ostream& operator << (ostream&, Instrument&);
 
-/** A note being played. This is a transient type that persists from the time a note is "played"
-	until it reaches the end of the sample it's supposed to play. Then it goes away. */
-class Note {
 private:
-	Instrument *instrument;
-	Sample *sample;
-	unsigned int velocity;
-	unsigned int number;
-	bool finished;
-	bool cancelled;
-
-public:
-	float samplePosition;
-	
-	Note()
-	: instrument(0)
-	, sample(0)
-	, velocity(0)
-	, number(0)
-	, finished(false)
-	, cancelled(false)
-	, samplePosition(0.0f)
-	{}
-
-	Instrument *getInstrument() { return instrument; }
-	Sample *getSample() { return sample; }
-	unsigned int getVelocity() { return velocity; }
-	unsigned int getNumber() { return number; }
-	
-	bool isFinished() { return finished; }
-	void finish(); 
-	
-	bool isCancelled() { return cancelled; }
-	void cancel();
-	/** Set this note up for use with the specified Instrument, sample, etc. */ 
-	void set(Instrument * inst, Sample * sample, unsigned int velocity, unsigned int number);
+	void clearVelocityTable();
+	void buildCrossfades();
 };
 
-ostream &operator << (ostream&, Note&);
+ostream& operator << (ostream&, Instrument&);
 
 // A map of MIDI note numbers to Instruments.
 typedef std::map<unsigned int, Instrument *> InstrumentMap;
@@ -392,10 +500,15 @@ class Drumkit {
 public:	
 	typedef std::vector<Submix*> SubmixList;
 	typedef std::map<string, Submix*> SubmixMap;
+
+	static const unsigned MIDI_NOTES = 128;
 	
 	Drumkit()
 	: level(100)
-	{}
+	, limiter(false)
+	, polyphony(0)
+	, stealing(Instrument::OLDEST)
+	{ clearNoteTable(); }
 
 	virtual ~Drumkit();
 	
@@ -405,11 +518,39 @@ public:
 	unsigned getLevel() { return level; }
 	Drumkit& setLevel(unsigned l) { level = l; return *this; }
 
-	Drumkit& clear() { instruments.clear(); return *this; }
+	/// Whether every bus gets a look-ahead limiter (they're all soft-clipped regardless).
+	bool hasLimiter() { return limiter; }
+	Drumkit& setLimiter(bool l) { limiter = l; return *this; }
+
+	/** How many voices the whole kit can play at once (0 for as many as SDDM
+		has), and which one gives way to a new hit when they're all in use. */
+	unsigned getPolyphony() { return polyphony; }
+	Drumkit& setPolyphony(unsigned p) { polyphony = p; return *this; }
+	Instrument::Stealing getStealing() { return stealing; }
+	Drumkit& setStealing(Instrument::Stealing s) { stealing = s; return *this; }
+
+	Drumkit& clear() { instruments.clear(); clearNoteTable(); return *this; }
 	Drumkit& add(unsigned int, Instrument *);
 	Instrument * findInstrumentByName(const char *);
 	Instrument * findByNoteNumber(unsigned int);
+
+	/** The instrument a note plays, or null if none. Kits don't say which
+		channel an instrument listens on, so it's the same on all of them.
+		Just an array lookup, so it's fine for the audio thread. */
+	Instrument * findByNote(unsigned note)
+	{
+		return (note < MIDI_NOTES) ? noteTable[note] : 0;
+	}
+
 	InstrumentList allInstruments();
+
+	static const unsigned MAX_CHOKE_GROUPS = 32;
+
+	/** Work out the choke groups from the victims: victims choked by the same
+		instruments share a group, and each instrument gets the groups it chokes.
+		Call once the victims are all set up. Returns false if that takes more
+		than MAX_CHOKE_GROUPS groups; the victims left over aren't choked. */
+	bool buildChokeGroups();
 	
 	Submix* addSubmix(string&);
 	Drumkit& addSubmix(Submix *);
@@ -427,11 +568,17 @@ public:
 	PortNameList getPortNames();
 
 private:
+	void clearNoteTable();
+
 	string name;
 	unsigned level;
+	bool limiter;
+	unsigned polyphony;
+	Instrument::Stealing stealing;
 	
 	SubmixMap submixes;
 	InstrumentMap instruments;
+	Instrument *noteTable[MIDI_NOTES];	///< Kept in step with "instruments" by add() and clear().
 	SceneList scenes;
 	string selectedSceneName;
 };
@@ -0,0 +1,77 @@
+// outputstage.h
+// the limiter and soft clipper every bus goes through on its way out
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef outputstage_h
+#define outputstage_h
+
+/** The last thing a bus (a submix or the main outputs) goes through each period,
+	once all of its voices have been mixed in.
+
+	If the kit asks for it, a look-ahead limiter pulls the level down just before
+	a peak would go over LIMIT_CEILING, and lets it back up slowly afterwards. Then
+	the soft clipper rounds off whatever is still too loud, so the bus never goes
+	past full scale. The limiter delays the bus by LOOKAHEAD frames; with it off,
+	nothing is delayed.
+
+	Everything is fixed-size, so it's safe on the audio thread.
+	*/
+class OutputStage {
+public:
+	/// How far ahead the limiter looks (and so how much it delays the bus), in frames.
+	static const unsigned LOOKAHEAD = 64;
+
+	OutputStage();
+
+	/** Turn the limiter on or off. Cheap enough to call every period. */
+	void setLimiter(bool on, unsigned sampleRate);
+	bool isLimiting() const { return limiting; }
+
+	/** Finish a period's worth of the bus, in place. "period" counts Jack periods;
+		a gap in it means the bus sat idle, so the limiter starts over. */
+	void process(float *left, float *right, unsigned frames, unsigned period);
+
+	/** Whether the limiter's delay line still holds some of the bus. Until it
+		doesn't, the bus has to be processed every period, with silence going in,
+		even if nothing plays into it; otherwise the end of it is never heard. */
+	bool isDraining() const { return limiting && quiet < LOOKAHEAD; }
+
+	/// The gain the limiter is applying right now (1 means it isn't doing anything).
+	float getGain() const { return gain; }
+
+private:
+	void reset();
+	void limit(float *left, float *right, unsigned frames);
+
+	bool limiting;
+	unsigned sampleRate;
+	float release;		///< How far the gain recovers each frame.
+	float gain;
+	float floor;		///< The lowest gain any frame in the look-ahead window needs.
+	unsigned head;
+	unsigned quiet;		///< Silent frames that have gone into the delay line since the last sound.
+	unsigned lastPeriod;
+
+	float delayL[LOOKAHEAD];
+	float delayR[LOOKAHEAD];
+	float needed[LOOKAHEAD];	///< The gain each frame in the delay line needs to stay under the ceiling.
+};
+
+#endif // outputstage_h
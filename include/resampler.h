@@ -0,0 +1,177 @@
+// resampler.h
+// interpolating kernels for rendering pitched notes
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef resampler_h
+#define resampler_h
+
+#include <cmath>
+
+#include "mixer.h"
+
+/** Reads a sample between its frames by drawing a straight line between the
+	two frames either side. Cheap, but rolls off the highs and aliases some. */
+struct LinearInterpolator {
+	enum { BEFORE = 0, AFTER = 1 };
+
+	LinearInterpolator(float) {}
+
+	/// "s" points at the frame at or before the position; "frac" is how far past it.
+	float operator () (const float *s, float frac) const
+	{
+		return s[0] + (s[1] - s[0]) * frac;
+	}
+};
+
+/** A 4-point cubic Hermite (Catmull-Rom) spline through the frames around the position. */
+struct CubicInterpolator {
+	enum { BEFORE = 1, AFTER = 2 };
+
+	CubicInterpolator(float) {}
+
+	float operator () (const float *s, float frac) const
+	{
+		float c1 = 0.5f * (s[1] - s[-1]);
+		float c2 = s[-1] - 2.5f * s[0] + 2.0f * s[1] - 0.5f * s[2];
+		float c3 = 0.5f * (s[2] - s[-1]) + 1.5f * (s[0] - s[1]);
+
+		return ((c3 * frac + c2) * frac + c1) * frac + s[0];
+	}
+};
+
+/** A Blackman-windowed sinc over SincInterpolator::TAPS frames.
+	The filter tables are worked out once, at startup. Voices pitched up get a
+	table with a lower cutoff, so what's above the new Nyquist is filtered out
+	instead of folding back down. */
+struct SincInterpolator {
+	enum { TAPS = 8, BEFORE = TAPS / 2 - 1, AFTER = TAPS / 2 };
+	enum { PHASES = 256, BANDS = 4 };
+
+	SincInterpolator(float step)
+	: filter(table[band(step)])
+	{}
+
+	float operator () (const float *s, float frac) const
+	{
+		const float *c = filter[(unsigned)(frac * PHASES + 0.5f)];
+		const float *p = s - BEFORE;
+
+		float sum = 0.0f;
+		for(unsigned i = 0; i < TAPS; ++i)
+			sum += p[i] * c[i];
+
+		return sum;
+	}
+
+	/// The filter table to use for a given step.
+	static unsigned band(float step)
+	{
+		if(step <= 1.0f)
+			return 0;
+		if(step <= 1.25f)
+			return 1;
+		if(step <= 1.667f)
+			return 2;
+		return 3;
+	}
+
+	static bool buildTables();
+
+	const float (*filter)[TAPS];
+
+	/// [band][phase][tap]. PHASES + 1 phases, so a "frac" that rounds up to 1 is covered.
+	static float table[BANDS][PHASES + 1][TAPS];
+};
+
+/** Mix "count" frames of a pitched voice into left/right, starting at "pos" and
+	stepping "step" frames of the sample per output frame.
+
+	"length" is the length of the sample; taps that fall outside it read as silence.
+	"pos" and "step" are 32.32 fixed point; "pos" is left where the next period
+	should pick up. peakL/peakR are raised to the loudest contribution mixed in,
+	as with Mixer::mix.
+	*/
+template <class Interpolator>
+void resample(
+	const float *sampleL, const float *sampleR, unsigned length
+, float *left, float *right, unsigned count
+, SamplePosition &pos, SamplePosition step
+, float gainL, float gainR
+, float &peakL, float &peakR)
+{
+	enum { BEFORE = Interpolator::BEFORE, AFTER = Interpolator::AFTER, TAPS = BEFORE + AFTER + 1 };
+
+	const float FRACTION_SCALE = 1.0f / (float)POSITION_ONE;
+
+	Interpolator interpolate((float)step * FRACTION_SCALE);
+	SamplePosition p = pos;
+
+	for(unsigned i = 0; i < count; ++i)
+	{
+		unsigned idx = (unsigned)(p >> POSITION_FRACTION_BITS);
+		float frac = (float)(unsigned)(p & POSITION_FRACTION_MASK) * FRACTION_SCALE;
+
+		float valueL, valueR;
+
+		if(idx >= (unsigned)BEFORE && idx + AFTER < length)
+		{
+			valueL = interpolate(sampleL + idx, frac);
+			valueR = interpolate(sampleR + idx, frac);
+		}
+		else
+		{
+			// Near either end of the sample: copy the taps we have, pad with silence.
+			float tapsL[TAPS], tapsR[TAPS];
+
+			for(int k = 0; k < TAPS; ++k)
+			{
+				int j = (int)idx - BEFORE + k;
+				bool inside = (j >= 0 && j < (int)length);
+
+				tapsL[k] = inside ? sampleL[j] : 0.0f;
+				tapsR[k] = inside ? sampleR[j] : 0.0f;
+			}
+
+			valueL = interpolate(tapsL + BEFORE, frac);
+			valueR = interpolate(tapsR + BEFORE, frac);
+		}
+
+		valueL *= gainL;
+		valueR *= gainR;
+
+		left[i] += valueL;
+		right[i] += valueR;
+
+		valueL = fabsf(valueL);
+		valueR = fabsf(valueR);
+
+		if(valueL > peakL)
+			peakL = valueL;
+
+		if(valueR > peakR)
+			peakR = valueR;
+
+		p += step;
+	}
+
+	pos = p;
+}
+
+#endif // resampler_h
@@ -0,0 +1,83 @@
+// ringbuffer.h
+// a lock-free queue for handing things between two threads
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ringbuffer_h
+#define ringbuffer_h
+
+/** A fixed-size, wait-free, single-producer/single-consumer queue.
+
+	Exactly one thread may push() and exactly one (other) thread may pop().
+	Neither call blocks or allocates, so either end can be the audio thread.
+	SIZE must be a power of two; the queue holds up to SIZE items.
+	*/
+template <typename T, unsigned SIZE>
+class RingBuffer {
+public:
+	RingBuffer()
+	: head(0)
+	, tail(0)
+	{}
+
+	/// Producer: add an item. Returns false (and drops it) if the queue is full.
+	bool push(const T& item)
+	{
+		unsigned t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+		if(t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) >= SIZE)
+			return false;
+
+		items[t & (SIZE - 1)] = item;
+		__atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	/// Consumer: take the oldest item. Returns false if the queue is empty.
+	bool pop(T& item)
+	{
+		unsigned h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		if(h == __atomic_load_n(&tail, __ATOMIC_ACQUIRE))
+			return false;
+
+		item = items[h & (SIZE - 1)];
+		__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	/// Either end: how many items are waiting. Only a snapshot.
+	unsigned size() const
+	{
+		return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	}
+
+	bool empty() const { return size() == 0; }
+
+private:
+	RingBuffer(const RingBuffer&);
+	RingBuffer& operator = (const RingBuffer&);
+
+	// Keep the two ends on separate cache lines so the threads don't fight over them.
+	unsigned head;
+	char padHead[64 - sizeof(unsigned)];
+	unsigned tail;
+	char padTail[64 - sizeof(unsigned)];
+	T items[SIZE];
+};
+
+#endif // ringbuffer_h
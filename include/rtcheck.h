@@ -0,0 +1,50 @@
+// rtcheck.h
+// catching heap allocations on the Jack process thread
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef rtcheck_h
+#define rtcheck_h
+
+/** Counts heap allocations made inside the Jack process callback.
+
+	Only active in builds configured with "qmake CONFIG+=rtcheck", which defines
+	SDDM_RT_ALLOC_CHECK and wraps malloc/calloc/realloc/free (and so new/delete).
+	Any of those called between RT_ENTER() and RT_LEAVE() on the same thread is
+	counted. Set SDDM_RT_ALLOC_ABORT in the environment to abort on the first one
+	instead, so it can be caught in a debugger.
+	*/
+class RTAllocCheck {
+public:
+	static void enter();
+	static void leave();
+
+	/// Number of allocations (and frees) seen on the process thread so far.
+	static unsigned long getCount();
+};
+
+#ifdef SDDM_RT_ALLOC_CHECK
+	#define RT_ENTER() RTAllocCheck::enter()
+	#define RT_LEAVE() RTAllocCheck::leave()
+#else
+	#define RT_ENTER()
+	#define RT_LEAVE()
+#endif
+
+#endif // rtcheck_h
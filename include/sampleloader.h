@@ -0,0 +1,90 @@
+// sampleloader.h
+// loads a kit's samples on several threads at once
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef sampleloader_h
+#define sampleloader_h
+
+#include <vector>
+#include <string>
+
+#include <pthread.h>
+
+class Sample;
+
+/** Decodes a list of sample files on a pool of threads.
+
+	Add every file up front, in the order they'll be wanted, then start() the
+	threads and take() the samples back one at a time, in that same order.
+	take() waits for a file that isn't loaded yet, so the caller can get on with
+	building instruments (and reporting progress) while the rest load. However
+	the threads happen to finish, the caller sees the same samples in the same
+	order, so the kit comes out the same every time.
+	*/
+class SampleLoader {
+public:
+	SampleLoader(int maxSamples = -1);
+
+	/// Stops the threads, and deletes any samples that were never taken.
+	~SampleLoader();
+
+	void add(const std::string &filename);
+
+	/** Add a file that's already been loaded (from a compiled kit, say), so it
+		comes back in its turn without a thread having to load it. */
+	void add(const std::string &filename, Sample *sample);
+
+	/** Start loading, on "threads" threads (0 for one per CPU). */
+	void start(unsigned threads = 0);
+
+	/** The next sample, in the order they were added. Null if it wouldn't load.
+		If "filename" isn't the next one (or there are none left), it's just
+		loaded on the spot, so a caller that gets out of step still gets the
+		right sample. */
+	Sample* take(const std::string &filename);
+
+	/** Stop loading. Files not started yet are skipped. */
+	void cancel();
+
+private:
+	struct Job {
+		std::string filename;
+		Sample *sample;
+		bool done;
+	};
+
+	static void* threadMain(void *arg);
+	void work();
+	void join();
+
+	int maxSamples;
+	std::vector<Job> jobs;
+	std::vector<pthread_t> threads;
+	unsigned nextJob;		///< The next file a thread should start on.
+	unsigned nextTaken;		///< The next one take() hands back.
+	bool cancelled;
+	pthread_mutex_t mutex;
+	pthread_cond_t loaded;	///< Signalled each time a file finishes.
+
+	SampleLoader(const SampleLoader&);
+	SampleLoader& operator=(const SampleLoader&);
+};
+
+#endif // sampleloader_h
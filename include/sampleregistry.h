@@ -0,0 +1,103 @@
+// sampleregistry.h
+// one shared, reference-counted copy of each sample file
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef sampleregistry_h
+#define sampleregistry_h
+
+#include <map>
+#include <string>
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+class Sample;
+
+/** Every sample that's loaded, shared between all the layers (and kits) that use it.
+
+	Samples are looked up by the canonical path of their file and the sample
+	limit they were loaded with, so a wave used by several layers or instruments
+	is only decoded once. Each acquire() must be matched by a release(); the
+	sample is deleted when the last user lets it go.
+
+	A new kit is loaded before the old one is retired, so the waves the two have
+	in common stay resident across a kit change and are never decoded again. A
+	wave whose file has changed since it was loaded is loaded afresh; the old copy
+	lives on until its users let it go.
+
+	All of it is safe to call from several threads at once.
+	*/
+class SampleRegistry {
+public:
+	/** The shared copy of "filename", loading it if it isn't resident yet. If
+		another thread is already loading it, waits for that instead. Null if it
+		won't load. */
+	static Sample* acquire(const std::string &filename, int maxSamples = -1);
+
+	/** The shared copy of "filename" if it's already resident, or null. */
+	static Sample* acquireResident(const std::string &filename, int maxSamples = -1);
+
+	/** Share a sample that was loaded some other way. If the same file is
+		already resident, "sample" is deleted and the resident one is returned. */
+	static Sample* adopt(Sample *sample, int maxSamples = -1);
+
+	/** Hold on to a sample we already have, so it stays loaded until a
+		matching release(). False (and nothing is held) if it never came from
+		the registry. */
+	static bool retain(const Sample *sample);
+
+	/** Let go of a sample. Samples that never came from the registry are
+		just deleted. */
+	static void release(const Sample *sample);
+
+	/// How many distinct samples are resident.
+	static unsigned size();
+
+	/// The full path of "filename", with links and ".." resolved.
+	static std::string canonicalPath(const std::string &filename);
+
+private:
+	struct Entry {
+		std::string key;
+		Sample *sample;
+		unsigned refs;
+		bool loading;		///< Someone is loading it; wait on "loaded".
+		bool current;		///< Still the one "key" finds; false once the file changes.
+		off_t size;
+		time_t modified;
+		long modifiedNanos;
+	};
+
+	typedef std::map<std::string, Entry*> KeyMap;
+	typedef std::map<const Sample*, Entry*> SampleMap;
+
+	static std::string keyFor(const std::string &path, int maxSamples);
+	static Entry* findCurrent(const std::string &key, const std::string &filename);
+	static Entry* insert(const std::string &key, const std::string &filename, Sample *sample);
+	static void forget(Entry *entry);
+
+	static KeyMap byKey;
+	static SampleMap bySample;
+	static pthread_mutex_t mutex;
+	static pthread_cond_t loaded;
+};
+
+#endif // sampleregistry_h
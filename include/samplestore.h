@@ -0,0 +1,62 @@
+// samplestore.h
+// an on-disk cache of decoded samples that are played straight out of memory maps
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef samplestore_h
+#define samplestore_h
+
+#include <string>
+
+class Sample;
+
+/** A directory of samples already decoded to planar 32-bit float.
+
+	Each wave gets one file, named after its full path, holding a small header
+	and then the left and right channels ready to play. Loading a sample that's
+	in the store is just an mmap: the Sample's dataL/dataR point straight into
+	the mapping, nothing is decoded or copied, and every SDDM on the machine
+	playing the same kit shares the same pages of the page cache.
+
+	An entry remembers the size and modification time of the wave it came from,
+	and is ignored (and rewritten) once the wave changes. The store is off until
+	a directory is set.
+	*/
+class SampleStore {
+public:
+	/** Where the store lives. Empty (the default) turns it off. */
+	static void setDirectory(const std::string &directory);
+	static const std::string &getDirectory() { return directory; }
+	static bool isEnabled() { return !directory.empty(); }
+
+	/** Map the stored copy of "filename", if there's an up-to-date one.
+		Returns null if there isn't. */
+	static Sample* map(const std::string &filename, int maxSamples = -1);
+
+	/** Write a freshly decoded sample into the store, replacing any stale copy.
+		Safe to call from several threads at once. */
+	static bool store(const Sample &sample, int maxSamples = -1);
+
+private:
+	static std::string entryFor(const std::string &filename, int maxSamples);
+
+	static std::string directory;
+};
+
+#endif // samplestore_h
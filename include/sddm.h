@@ -20,15 +20,17 @@
 #ifndef _sddm_h
 #define _sddm_h
 
-#include <deque>
-#include <set>
+#include <map>
+
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "audio_driver.h"
 #include "midi.h"
 #include "config.h"
-
-/** A deque of notes (hence the name). */
-typedef std::deque<Note*> NoteQueue;
+#include "voice.h"
+#include "ringbuffer.h"
+#include "diskstream.h"
 
 /** A list of Submixes */
 typedef std::vector<Submix*> SubmixList;
@@ -49,37 +51,91 @@ struct oops: std::exception {
 	: message(msg.c_str()) {}
 };
 
-struct INoteQueueListener {
-	virtual ~INoteQueueListener() {}
+struct IVoicePoolListener {
+	virtual ~IVoicePoolListener() {}
 	
-	virtual void noteQueueUpdate(const NoteQueue *) = 0;
+	virtual void voicePoolUpdate(const VoicePool *) = 0;
 };
 
-typedef std::vector<INoteQueueListener *> NoteQueueListenerList;
+typedef std::vector<IVoicePoolListener *> VoicePoolListenerList;
+
+/** A MIDI event, boiled down to what the audio thread needs to start a voice. */
+struct NoteEvent {
+	unsigned char type;		///< MidiMessage::MidiMessageType
+	unsigned char channel;
+	unsigned char note;
+	unsigned char velocity;
+	unsigned short offset;	///< Frame offset into the period it should start in.
+	unsigned char timed;	///< Whether "time" is when the event really happened.
+	unsigned time;			///< Frame time it happened (or was queued) at.
+};
+
+/** Events on their way from the MIDI thread to the audio thread. */
+typedef RingBuffer<NoteEvent, 256> NoteEventQueue;
+
+/** A loaded kit, tagged with the order it was loaded in.
+	Voices remember the generation they were started from, so a retired kit
+	(and its instruments and submixes) is only deleted once nothing plays it.
+	*/
+struct KitGeneration {
+	Drumkit *kit;
+	unsigned number;
+
+	KitGeneration(Drumkit *k, unsigned n)
+	: kit(k)
+	, number(n)
+	{}
+};
 
 /** Our listener. Processes MIDI and audio input from
  Alsa and Jack, and plays Notes.
  */
 struct SDDM: IMIDIListener, IAudioListener {
 private:
-	Drumkit *kit;
-	NoteQueue pendingNotes;
-	NoteQueue playingNotes;
-	NoteQueue availableNotes;
-	std::set<Submix*> orphanSubmixes;
-	std::set<Instrument*> orphanInstruments;
+	KitGeneration *current;		///< Published by loadKit for the audio thread.
+	KitGeneration *playing;		///< The one the audio thread is using this period.
+	unsigned liveGeneration;	///< Oldest generation the audio thread still uses.
+	NoteEventQueue events;		///< From the MIDI thread.
+	NoteEventQueue rtEvents;	///< From MIDI drivers running on the process thread.
+	unsigned long droppedEvents;
+	unsigned long queuedNotes;			///< Notes taken off the queue so far.
+	unsigned long long queueDelayTotal;	///< Frames they spent in it, all told.
+	unsigned queueDelayMax;				///< Longest any one of them spent in it.
+	unsigned long unroutedVoices;		///< Voices cut off because their submix had no bus.
+	VoicePool voices;
+	DiskStreamer streamer;		///< Plays the parts of long samples that aren't in memory.
+	OutputStage mainOutput;		///< The main ports' limiter/clipper.
+	unsigned periods;			///< Periods the audio thread has run, for the OutputStages.
+	int busSlot[AudioDriver::MAX_PORTS];				///< This period's slot for each bus (by left port), or -1.
+	int busPort[AudioDriver::MAX_BUFFER_REQUESTS];		///< The bus in each slot.
+	unsigned busStart[AudioDriver::MAX_BUFFER_REQUESTS + 1];	///< Where each slot's voices start in busVoices.
+	unsigned busCount;									///< Slots in use this period.
+	Submix *busMix[AudioDriver::MAX_BUFFER_REQUESTS];	///< The submix in each slot; null for the main ports.
+	Submix *draining[AudioDriver::MAX_BUFFER_REQUESTS];	///< Submixes with a limiter tail still to play out.
+	unsigned drainCount;
+	bool mainDraining;									///< The main ports have one too.
+	unsigned *busVoices;								///< This period's playing voices, grouped by bus.
+	std::vector<KitGeneration*> retiredKits;
+	std::map<Submix*, unsigned> orphanSubmixes;
+	std::map<Instrument*, unsigned> orphanInstruments;
 	unsigned sampleEndGap;
 	int maxPolyphony;
 	bool verbose;
 	AudioDriver * audioDriver;
 	MidiDriver * midiDriver;
+	pthread_t cleanupThread;	///< Runs deleteOrphans for MIDI that arrives on the process thread.
+	sem_t cleanupWakeup;
+	bool cleanupRunning;
+	bool cleanupQuit;
+
+	static void* cleanupMain(void *arg);
 
 public:
 	static SDDM * instance;
 	SDDM();
 	virtual ~SDDM();
 	
-	NoteQueueListenerList noteQueueListeners;
+	VoicePoolListenerList voicePoolListeners;
 	
 	bool loadKit(
 		const char *filename
@@ -94,8 +150,7 @@ public:
 	MidiDriver * getMidiDriver() { return midiDriver; }
 	void setMidiDriver(MidiDriver * driver) { midiDriver = driver; }
 
-	Drumkit* getDrumkit() const { return kit; }
-	void setDrumkit(Drumkit * dk) { kit = dk; }
+	Drumkit* getDrumkit() const { return current ? current->kit : 0; }
 
 	unsigned getSampleEndGap() { return sampleEndGap; }
 	const SDDM& setSampleEndGap(unsigned gap) { sampleEndGap = gap; return *this; }
@@ -105,25 +160,58 @@ public:
 	
 	void onMidiMessage(const MidiMessage& msg);
 	
-	bool hasSubmix(SubmixList& list, Submix* mix);
+	void getBufferRequests(BufferRequestList& requests, unsigned frames);
 	
-	// Return a list of unique submixes for the specified notes.
-	SubmixList getSubMixesFor(NoteQueue& notes);
+	// Voice limits and stealing, for startVoice.
+	unsigned countVoices(Instrument * inst);
+	unsigned getVoiceLimit();
+	int findVictim(Instrument * inst, unsigned noteNumber, Instrument::Stealing policy);
+	void makeRoomFor(Instrument * inst, unsigned noteNumber, unsigned count);
 
-	BufferRequestList getBufferRequests();
-	
-	// Return notes destined for the specified Submix.
-	// If the specified Submix is null, return notes not destined for any submix.
-	NoteQueue findPlayableNotes(NoteQueue& notes, Submix* mix);
-			
+	// Sort the playing voices by bus and request a buffer for each bus in use.
+	void groupVoicesByBus(BufferRequestList& requests);
+
+	// Each bus only touches its own voices, so buses can be mixed side by side.
+	// Finished voices are cleared out in playDone(), once they all are.
 	void play(BufferResponse* response);
-	void pushNote(Note * note);
-	Note * findLRUNote();
+	bool playsInParallel() { return true; }
+	void playDone();
+
+	// Audio thread: start voices for the note events that came in since the last period.
+	void drainEvents();
+	void drainEvents(NoteEventQueue& queue, unsigned now, int period);
+
+	// Start a voice for the specified instrument and sample.
+	// Call makeRoomFor first, once for all the voices a hit starts: if the
+	// instrument or the kit is at its voice limit, voices picked by its stealing
+	// policy fade out to make room. If every slot is in use, one is cut off.
+	// The voice starts "offset" frames into the current period, and plays at "level" (0-1).
+	void startVoice(Instrument * inst, const Sample * sample, unsigned velocity, unsigned noteNumber, unsigned offset, float level);
+
+	// Take a voice out of the table, closing its stream if it has one.
+	void removeVoice(unsigned i);
 	
-	// Remove all notes for the instruments in the specified list.
-	void cancelNotesFor(InstrumentList& victims, NoteQueue& notes);
+	// Fade out all voices in the specified choke groups (a mask).
+	void chokeVoices(uint32_t groups);
+
+	// Delete retired kits, instruments and submixes that nothing plays any more.
+	void deleteOrphans();
+
+	/// How many note events were dropped because the queue was full.
+	unsigned long getDroppedEvents() const { return droppedEvents; }
+
+	/// How many notes have come through the queue, and how long (in frames) they waited
+	/// between arriving and starting to play. Only a snapshot; the audio thread updates these.
+	unsigned long getQueuedNotes() const { return __atomic_load_n(&queuedNotes, __ATOMIC_RELAXED); }
+	unsigned long long getQueueDelayTotal() const { return __atomic_load_n(&queueDelayTotal, __ATOMIC_RELAXED); }
+	unsigned getQueueDelayMax() const { return __atomic_load_n(&queueDelayMax, __ATOMIC_RELAXED); }
+
+	/// How many voices were cut off because their submix had no ports, or no bus slot was left.
+	unsigned long getUnroutedVoices() const { return __atomic_load_n(&unroutedVoices, __ATOMIC_RELAXED); }
+
+	/// How many times a streamed voice got to frames the disk hadn't delivered yet.
+	unsigned getStreamUnderruns() const { return streamer.getUnderruns(); }
 	
-	static pthread_mutex_t notemutex;
 	static pthread_mutex_t orphanmutex;
 };
 
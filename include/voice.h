@@ -0,0 +1,107 @@
+// voice.h
+// the table of voices (playing notes) used by the audio thread
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef voice_h
+#define voice_h
+
+#include "model.h"
+#include "mixer.h"
+
+/** A fixed-capacity table of voices.
+
+	A voice is a note being played: it persists from the time a note is "played"
+	until it reaches the end of the sample it's supposed to play. Each field of a
+	voice lives in its own array, so the mixer walks contiguous memory instead of
+	chasing Note objects around the heap. Voices in use always occupy slots
+	0..size()-1; removing one moves the last voice into its slot.
+	*/
+class VoicePool {
+public:
+	enum Flags {
+		PENDING = 1,	///< Started, but not playing until the audio thread picks it up.
+		FINISHED = 2,	///< Done. Will be removed at the end of the period.
+		CANCELLED = 4	///< Cut off (by mute, a full table, etc.). Never mixed again.
+	};
+
+	VoicePool(unsigned capacity);
+	~VoicePool();
+
+	unsigned getCapacity() const { return capacity; }
+	unsigned size() const { return count; }
+	bool empty() const { return count == 0; }
+	bool isFull() const { return count == capacity; }
+
+	/** Start a new (pending) voice. Returns its slot, or -1 if the table is full. */
+	int add(Instrument * inst, const Sample * sample, unsigned velocity, unsigned number);
+
+	/** Remove the voice in the specified slot, by moving the last voice into it. */
+	void remove(unsigned i);
+
+	/** Return the slot of the oldest voice, or -1 if there are none. */
+	int findOldest() const;
+
+	bool isPending(unsigned i) const { return (flags[i] & PENDING) != 0; }
+	bool isFinished(unsigned i) const { return (flags[i] & FINISHED) != 0; }
+	bool isCancelled(unsigned i) const { return (flags[i] & CANCELLED) != 0; }
+
+	bool isReleasing(unsigned i) const { return fadeStep[i] > 0.0f; }
+
+	void start(unsigned i) { flags[i] &= ~PENDING; }
+	void finish(unsigned i);
+	void cancel(unsigned i);
+
+	/** Fade the voice out, dropping its gain by "step" each frame; it finishes
+		once it's silent. A voice already fading out faster keeps its own pace. */
+	void release(unsigned i, float step);
+
+	// The voices. Each array has getCapacity() entries.
+	SamplePosition *position;	///< Current (fractional) frame in the sample.
+	SamplePosition *step;		///< Frames to advance per output frame.
+	float *gainL, *gainR;		///< Output gains, updated once per period.
+	float *level;				///< Gain from the layer crossfade, set at note-on.
+	const float **dataL, **dataR;
+	unsigned *frames;			///< Length of the sample, in frames.
+	unsigned *resident;			///< How many of those are in dataL/dataR; the rest come from "stream".
+	int *stream;				///< Its DiskStreamer stream, or -1 if it plays from memory.
+	Instrument **instrument;
+	unsigned char *velocity;
+	unsigned char *number;		///< MIDI note number.
+	unsigned char *flags;
+	unsigned char *interpolation;	///< Instrument::Interpolation, for when the voice is pitched.
+	unsigned *serial;			///< Start order. Lower is older.
+	unsigned *offset;			///< Frames to wait, from the start of the period, before playing.
+	unsigned *generation;		///< Generation of the kit the voice was started from.
+	int *bus;					///< Left port handle of the bus it mixes into, fixed at note-on.
+	float *fade;				///< Multiplies the gains while the voice fades out; 1 otherwise.
+	float *fadeStep;			///< How much "fade" drops each frame. 0 unless the voice is fading out.
+	float *loudness;			///< Its loudest output last period, for picking a voice to steal.
+	uint32_t *chokeGroup;		///< Its instrument's choke group, as a bit.
+
+private:
+	VoicePool(const VoicePool &);
+	VoicePool & operator = (const VoicePool &);
+
+	unsigned capacity;
+	unsigned count;
+	unsigned nextSerial;
+};
+
+#endif // voice_h
@@ -0,0 +1,85 @@
+// worker.h
+// a pool of Jack real-time threads that share out the work of a period
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef worker_h
+#define worker_h
+
+#include <semaphore.h>
+
+#include <jack/jack.h>
+#include <jack/thread.h>
+
+/** Work that can be split into independent pieces.
+	run() is called once for each index, in no particular order, possibly on
+	several threads at once. */
+struct IParallelJob {
+	virtual ~IParallelJob() {}
+
+	virtual void run(unsigned index) = 0;
+};
+
+/** A fixed set of helper threads for the process callback.
+
+	The threads are made with jack_client_create_thread, so they run at the
+	Jack client's real-time priority. They sleep on a semaphore until the
+	process thread hands them a job, then take pieces of it until there are
+	none left. The process thread takes pieces too, and doesn't return until
+	every piece is done. Nothing here allocates or takes a lock.
+	*/
+class WorkerPool {
+public:
+	static const unsigned MAX_THREADS = 16;
+
+	WorkerPool();
+	~WorkerPool();
+
+	/** Start "threads" helper threads for the client (clamped to MAX_THREADS).
+		With none, the process thread just does everything itself. */
+	bool start(jack_client_t *client, unsigned threads);
+
+	/** Stop and join the helper threads. */
+	void stop();
+
+	unsigned getThreadCount() const { return threadCount; }
+
+	/** Run job.run(0) .. job.run(count - 1) across the pool and the calling
+		thread. Returns once they've all finished. Process thread only. */
+	void run(IParallelJob &job, unsigned count);
+
+private:
+	static void* threadMain(void *arg);
+	void work();
+
+	jack_client_t *client;
+	jack_native_thread_t threads[MAX_THREADS];
+	unsigned threadCount;
+	sem_t wake;		///< Posted once per helper wanted.
+	sem_t done;		///< Posted by each helper once it runs out of pieces.
+	IParallelJob *job;
+	unsigned jobCount;
+	unsigned next;	///< The next piece to hand out.
+	bool quit;
+
+	WorkerPool(const WorkerPool&);
+	WorkerPool& operator=(const WorkerPool&);
+};
+
+#endif // worker_h
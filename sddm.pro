@@ -24,9 +24,21 @@ SOURCES += src/main.cpp\
     src/scene.cpp \
     src/log.cpp \
     src/Sample.cpp \
+    src/sampleloader.cpp \
+    src/samplestore.cpp \
+    src/kitcache.cpp \
+    src/sampleregistry.cpp \
+    src/diskstream.cpp \
     src/alsamidi.cpp \
+    src/jackmidi.cpp \
     src/nsmclient.cpp \
-    src/app.cpp
+    src/app.cpp \
+    src/mixer.cpp \
+    src/outputstage.cpp \
+    src/resampler.cpp \
+    src/voice.cpp \
+    src/worker.cpp \
+    src/rtcheck.cpp
 
 HEADERS  += include/mainwindow.h \
     include/sddm.h \
@@ -34,17 +46,35 @@ HEADERS  += include/mainwindow.h \
     include/midi.h \
     include/config.h \
     include/model.h \
+    include/sampleloader.h \
+    include/samplestore.h \
+    include/kitcache.h \
+    include/sampleregistry.h \
+    include/diskstream.h \
     include/scene.h \
     include/alsamidi.h \
+    include/jackmidi.h \
     include/streamer.h \
     include/myxml.h \
     include/log.h \
     include/nsmclient.h \
     include/nonlib_nsm.h \
-    include/app.h
+    include/app.h \
+    include/mixer.h \
+    include/outputstage.h \
+    include/resampler.h \
+    include/voice.h \
+    include/worker.h \
+    include/rtcheck.h \
+    include/ringbuffer.h
 
 FORMS    += mainwindow.ui
 
+# qmake CONFIG+=rtcheck: count heap allocations on the Jack process thread
+rtcheck {
+    DEFINES += SDDM_RT_ALLOC_CHECK
+}
+
 LIBS += -ljack -lsndfile -lasound -lsamplerate -llo
 
 target.path = /usr/local/bin/
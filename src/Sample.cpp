@@ -31,11 +31,15 @@
 #include <sndfile.h>
 #include <samplerate.h>
 
+#include <sys/mman.h>
+
 #include <jack/jack.h>
 
 using namespace std;
 
 #include "model.h"
+#include "samplestore.h"
+#include "diskstream.h"
 
 typedef std::vector<float> FloatList;
 
@@ -44,16 +48,24 @@ static FloatList sample_rate_convert(SNDFILE *infile, int converter, double src_
 ///--- Sample
 Sample::Sample(unsigned frames, const string& filename)
 : filename(filename)
+, mapping(0)
+, mappingLength(0)
 , dataL(NULL)
 , dataR(NULL)
 , frames(frames)
+, totalFrames(frames)
 , sampleRate(44100)
 {}
 
 Sample::~Sample()
 {
-	delete[] dataL;
-	delete[] dataR;
+	if(mapping)
+		munmap(mapping, mappingLength);
+	else
+	{
+		delete[] dataL;
+		delete[] dataR;
+	}
 }
 
 Sample* Sample::load(const string& filename, int maxSamples)
@@ -61,7 +73,30 @@ Sample* Sample::load(const string& filename, int maxSamples)
 	string ext = filename.substr(filename.length()-3, filename.length());
 
 	if(ext == "wav" || ext == "WAV")
-		return loadWave(filename, maxSamples);
+	{
+		// The store only holds whole samples.
+		if(DiskStreamer::isEnabled())
+			return loadWave(filename, maxSamples);
+
+		Sample *sample = SampleStore::map(filename, maxSamples);
+		if(sample)
+			return sample;
+
+		sample = loadWave(filename, maxSamples);
+
+		// Put it in the store, and play it from there like everyone else will.
+		if(sample && SampleStore::store(*sample, maxSamples))
+		{
+			Sample *mapped = SampleStore::map(filename, maxSamples);
+			if(mapped)
+			{
+				delete sample;
+				sample = mapped;
+			}
+		}
+
+		return sample;
+	}
 	else
 	{
 		cerr << filename << " is not a wave file. That's all I support for now. Sorry." << endl;
@@ -87,15 +122,20 @@ Sample* Sample::loadWave(const string& filename, int maxSamples)
 		return 0;
 	}
 
-	float *buffer = new float[info.frames * info.channels];
-	memset(buffer, 0, sizeof(float) * (info.frames * info.channels));
-	sf_read_float(file, buffer, info.frames * info.channels);
-	sf_close(file);
+	int total = info.frames;
 
-	int size = info.frames;
-	
 	if(maxSamples != -1)
-		size = min((int)info.frames, maxSamples);
+		total = min((int)info.frames, maxSamples);
+
+	// Leave all but the start of a long sample on disk, for the DiskStreamer.
+	int size = total;
+	if(DiskStreamer::isEnabled())
+		size = min(total, (int)DiskStreamer::preloadFrames(info.samplerate));
+
+	float *buffer = new float[size * info.channels];
+	memset(buffer, 0, sizeof(float) * (size * info.channels));
+	sf_readf_float(file, buffer, size);
+	sf_close(file);
 	
 	
 #ifdef _SAMPLE_RATE_CHANGE		
@@ -164,6 +204,7 @@ Sample* Sample::loadWave(const string& filename, int maxSamples)
 	Sample *sample = new Sample(size, filename);
 	sample->dataL = dataL;
 	sample->dataR = dataR;
+	sample->totalFrames = total;
 	sample->sampleRate = info.samplerate;
 	
 	return sample;
@@ -39,6 +39,51 @@ int npfd;
 struct pollfd *pfd;
 int portId;
 int clientId;
+int queueId = -1;
+
+/** Our queue's clock, read at most once for each batch of events midi_action
+	drains, rather than with a system call per event. */
+struct QueueClock {
+	snd_seq_real_time_t now;
+	bool read;		///< We've tried to read it this batch.
+	bool valid;		///< And it worked.
+
+	QueueClock() : read(false), valid(false) {}
+};
+
+/** How long ago (in microseconds) ALSA stamped the event, by our queue's clock.
+	Returns -1 if the event wasn't stamped in real time on our queue. */
+static int eventAge(snd_seq_t *seq_handle, const snd_seq_event_t *ev, QueueClock &clock)
+{
+	if(queueId < 0 || ev->queue != queueId || (ev->flags & SND_SEQ_TIME_STAMP_MASK) != SND_SEQ_TIME_STAMP_REAL)
+	{
+		return -1;
+	}
+
+	if(!clock.read)
+	{
+		clock.read = true;
+
+		snd_seq_queue_status_t *status;
+		snd_seq_queue_status_alloca(&status);
+		if(snd_seq_get_queue_status(seq_handle, queueId, status) >= 0)
+		{
+			clock.now = *snd_seq_queue_status_get_real_time(status);
+			clock.valid = true;
+		}
+	}
+
+	if(!clock.valid)
+	{
+		return -1;
+	}
+
+	// Events that came in after the clock was read come out a little negative; call those 0.
+	long age = ((long)clock.now.tv_sec - (long)ev->time.time.tv_sec) * 1000000
+		+ ((long)clock.now.tv_nsec - (long)ev->time.time.tv_nsec) / 1000;
+
+	return (age > 0) ? (int)age : 0;
+}
 
 void* alsaMidiDriver_thread(void* param)
 {
@@ -59,16 +104,40 @@ void* alsaMidiDriver_thread(void* param)
 
 	snd_seq_set_client_name(seq_handle, pDriver->getClientName().c_str());
 
-	if((portId = snd_seq_create_simple_port(seq_handle,
-									"midi in",
-									SND_SEQ_PORT_CAP_WRITE |
-									SND_SEQ_PORT_CAP_SUBS_WRITE,
-									SND_SEQ_PORT_TYPE_APPLICATION
-								)) < 0)
+	// Have ALSA stamp incoming events with the real time they arrived, by our
+	// own queue, so we can tell how long they waited for us.
+	queueId = snd_seq_alloc_named_queue(seq_handle, "sddm");
+	if(queueId < 0)
+	{
+		cerr << "Error allocating sequencer queue; MIDI timing will be period-quantized." << endl;
+	}
+
+	snd_seq_port_info_t *portInfo;
+	snd_seq_port_info_alloca(&portInfo);
+	snd_seq_port_info_set_name(portInfo, "midi in");
+	snd_seq_port_info_set_capability(portInfo, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+	snd_seq_port_info_set_type(portInfo, SND_SEQ_PORT_TYPE_APPLICATION);
+
+	if(queueId >= 0)
+	{
+		snd_seq_port_info_set_timestamping(portInfo, 1);
+		snd_seq_port_info_set_timestamp_real(portInfo, 1);
+		snd_seq_port_info_set_timestamp_queue(portInfo, queueId);
+	}
+
+	if(snd_seq_create_port(seq_handle, portInfo) < 0)
 	{
 		cerr << "Error creating sequencer port.";
 		pthread_exit(NULL);
 	}
+
+	portId = snd_seq_port_info_get_port(portInfo);
+
+	if(queueId >= 0)
+	{
+		snd_seq_start_queue(seq_handle, queueId, NULL);
+		snd_seq_drain_output(seq_handle);
+	}
 	
 	clientId = snd_seq_client_id(seq_handle);
 
@@ -98,6 +167,12 @@ void* alsaMidiDriver_thread(void* param)
 		/* set in and out ports */
 		snd_seq_port_subscribe_set_sender(subs, &sender);
 		snd_seq_port_subscribe_set_dest(subs, &dest);
+		if(queueId >= 0)
+		{
+			snd_seq_port_subscribe_set_queue(subs, queueId);
+			snd_seq_port_subscribe_set_time_update(subs, 1);
+			snd_seq_port_subscribe_set_time_real(subs, 1);
+		}
 
 		/* subscribe */
 		int ret = snd_seq_subscribe_port(seq_handle, subs);
@@ -119,6 +194,12 @@ void* alsaMidiDriver_thread(void* param)
 		}
 	}
 	
+	if(queueId >= 0)
+	{
+		snd_seq_free_queue(seq_handle, queueId);
+		queueId = -1;
+	}
+
 	snd_seq_close(seq_handle);
 	seq_handle = NULL;
 
@@ -181,6 +262,8 @@ void AlsaMidiDriver::connectPort(string &port, string &target)
 void AlsaMidiDriver::midi_action(snd_seq_t *seq_handle)
 {
 	snd_seq_event_t *ev;
+	QueueClock clock;
+
 	do {
 		if (!seq_handle) {
 			break;
@@ -197,6 +280,7 @@ void AlsaMidiDriver::midi_action(snd_seq_t *seq_handle)
 					msg.data1 = ev->data.note.note;
 					msg.data2 = ev->data.note.velocity;
 					msg.channel = ev->data.control.channel;
+					msg.age = eventAge(seq_handle, ev, clock);
 					break;
 
 				case SND_SEQ_EVENT_NOTEOFF:
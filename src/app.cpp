@@ -25,9 +25,13 @@ using namespace std;
 #include "model.h"
 #include "sddm.h"
 #include "nsmclient.h"
+#include "samplestore.h"
+#include "diskstream.h"
+#include "kitcache.h"
 
 
 #include <iostream>
+#include <cstdlib>
 using namespace std;
 
 void App::start(char *argv0)
@@ -38,7 +42,39 @@ void App::start(char *argv0)
     midiDriver.addMIDIListener(SDDM::instance);
     midiDriver.addMIDIListener(this);
 
+    // Jack MIDI events arrive on the process thread, so only SDDM listens to them.
+    // The driver goes ahead of SDDM so its notes start in the period they arrive.
+    jackMidiDriver.addMIDIListener(SDDM::instance);
+
     SDDM::instance->setAudioDriver(&jackDriver);
+
+    // SDDM_RENDER_THREADS sets how many threads help mix submixes (0 for none).
+    const char *renderThreads = getenv("SDDM_RENDER_THREADS");
+    if(renderThreads) {
+        jackDriver.setRenderThreads(atoi(renderThreads));
+    }
+
+    // SDDM_SAMPLE_CACHE names a directory to keep decoded samples in, so later
+    // loads (by this or any other SDDM) just map them.
+    const char *sampleCache = getenv("SDDM_SAMPLE_CACHE");
+    if(sampleCache) {
+        SampleStore::setDirectory(sampleCache);
+    }
+
+    // SDDM_KIT_CACHE_VERIFY checks every wave in a compiled kit against its
+    // hash as it loads. Slower, since it reads all of them.
+    const char *verifyKitCache = getenv("SDDM_KIT_CACHE_VERIFY");
+    if(verifyKitCache && atoi(verifyKitCache) > 0) {
+        KitCache::setVerify(true);
+    }
+
+    // SDDM_STREAM_PRELOAD keeps just the first so many milliseconds of each
+    // sample in memory, and streams the rest from disk as it plays.
+    const char *streamPreload = getenv("SDDM_STREAM_PRELOAD");
+    if(streamPreload && atoi(streamPreload) > 0) {
+        DiskStreamer::setPreload(atoi(streamPreload));
+    }
+    jackDriver.addAudioListener(&jackMidiDriver);
     jackDriver.addAudioListener(SDDM::instance);
 
     // NSM - are we part of a session?
@@ -59,6 +95,7 @@ void App::openDrivers(QString clientId) {
     string clientName = clientId.toStdString();
     if(midiDriver.isActive()) {
         midiDriver.close();
+        jackMidiDriver.close();
         jackDriver.close();
     }
     // MIDI driver
@@ -66,6 +103,9 @@ void App::openDrivers(QString clientId) {
     midiDriver.setActive(true);
     // Audio driver
     jackDriver.open(clientName);
+    // Jack MIDI driver (needs the Jack client)
+    jackMidiDriver.open(clientName);
+    jackMidiDriver.setActive(true);
 }
 
 bool App::openFile(QString fileName) {
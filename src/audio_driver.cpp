@@ -26,6 +26,7 @@
 #include <stdio.h>
 
 #include <pthread.h>
+#include <unistd.h>
 
 #include <sndfile.h>
 #include <jack/jack.h>
@@ -36,6 +37,7 @@ using namespace std;
 #include "midi.h"
 #include "alsamidi.h"
 #include "audio_driver.h"
+#include "rtcheck.h"
 
 // static stuff
 const char* AudioDriver::LEFT_PORT_NAME = "left";
@@ -46,7 +48,6 @@ pthread_t jackThread;
 //
 // static stuff
 //
-typedef jack_default_audio_sample_t sample_t;
 jack_client_t *JackAudioDriver::client = 0;
 
 int JackAudioDriver::jackProcess(jack_nframes_t frames, void* arg)
@@ -76,14 +77,26 @@ void JackAudioDriver::jackOff(void *arg)
 // JackAudioDriver
 //
 
+JackAudioDriver::JackAudioDriver()
+: portCount(0)
+, cycles(0)
+, renderThreads(-1)
+{
+	pthread_mutex_init(&portLock, 0);
+	memset(ports, 0, sizeof(ports));
+	memset(buffers, 0, sizeof(buffers));
+	requests.reserve(MAX_BUFFER_REQUESTS);
+}
 
 JackAudioDriver::~JackAudioDriver()
 {
-  jack_port_unregister(client, left);
-  jack_port_unregister(client, right);
+  jack_port_unregister(client, ports[LEFT_PORT]);
+  jack_port_unregister(client, ports[RIGHT_PORT]);
 
 	jack_client_close(client);
 	JackAudioDriver::client = 0;
+
+	pthread_mutex_destroy(&portLock);
 }
 
 void JackAudioDriver::onJackSampleRateChange(jack_nframes_t frames)
@@ -94,12 +107,26 @@ void JackAudioDriver::onJackSampleRateChange(jack_nframes_t frames)
 void JackAudioDriver::onJackBufferSize(jack_nframes_t frames)
 {
 	cout << "jack buffer size set to " << frames << " frames" << endl;
+	bufferSize = frames;
 }
 
 void JackAudioDriver::close()
 {
+	// Stop the process callback before its helpers go away.
+	jack_deactivate(client);
+	workers.stop();
+
+	// Nothing is processing any more, so the retired ports can all go.
+	pthread_mutex_lock(&portLock);
+	reapPorts(true);
+	pthread_mutex_unlock(&portLock);
+
 	jack_client_close(client);
 	JackAudioDriver::client = 0;
+
+#ifdef SDDM_RT_ALLOC_CHECK
+	cout << "RTAllocCheck: " << RTAllocCheck::getCount() << " heap allocations on the process thread" << endl;
+#endif
 }
 
 void* jack_thread(void* /*param*/)
@@ -110,33 +137,123 @@ void* jack_thread(void* /*param*/)
 	return NULL;
 }
 
-bool JackAudioDriver::registerPort(string & name)
+PortHandle JackAudioDriver::registerPort(string & name)
 {
+	pthread_mutex_lock(&portLock);
+
+	// Ports retired a while ago may still hold a name we want back.
+	reapPorts(false);
+
+	// Find a free slot. The main ports always get the first two.
+	unsigned slot = 0;
+	while(slot < MAX_PORTS && ports[slot])
+		++slot;
+
+	if(slot >= MAX_PORTS)
+	{
+		pthread_mutex_unlock(&portLock);
+		cerr << "Unable to register " << name << ": too many ports" << endl;
+		return NO_PORT;
+	}
+
 	jack_port_t * port = jack_port_register(JackAudioDriver::client, name.c_str(), JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
-	if(port)
+	if(!port)
 	{
-		portMap[name] = port;
+		pthread_mutex_unlock(&portLock);
+		return NO_PORT;
 	}
-	
-	return (port != 0);
+
+	// The process thread reads the table without locking, so publish the
+	// port before making its slot visible.
+	__atomic_store_n(&ports[slot], port, __ATOMIC_RELEASE);
+	if(slot >= portCount)
+	{
+		__atomic_store_n(&portCount, slot + 1, __ATOMIC_RELEASE);
+	}
+
+	portHandles[name] = (PortHandle)slot;
+
+	pthread_mutex_unlock(&portLock);
+	return (PortHandle)slot;
 }
 
-bool JackAudioDriver::unregisterPort(string& name)
+bool JackAudioDriver::unregisterPort(PortHandle handle)
 {
-	jack_port_t * port = portMap[name];
-	int rc = jack_port_unregister(JackAudioDriver::client, port);
-	portMap.erase(name);
-	return rc == 0;
+	pthread_mutex_lock(&portLock);
+
+	if(handle < 0 || (unsigned)handle >= MAX_PORTS || !ports[handle])
+	{
+		pthread_mutex_unlock(&portLock);
+		return false;
+	}
+
+	// Take it out of the table, so the next period doesn't pick it up. The
+	// process thread may be in the middle of this one with it, though, so it
+	// isn't unregistered until that period is over.
+	RetiredPort retired;
+	retired.port = ports[handle];
+	retired.cycle = __atomic_load_n(&cycles, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&ports[handle], (jack_port_t*)0, __ATOMIC_RELEASE);
+	retiredPorts.push_back(retired);
+
+	for(PortHandleMap::iterator e = portHandles.begin(); e != portHandles.end(); ++e)
+	{
+		if(e->second == handle)
+		{
+			portHandles.erase(e);
+			break;
+		}
+	}
+
+	reapPorts(false);
+
+	pthread_mutex_unlock(&portLock);
+	return true;
 }
 
-bool JackAudioDriver::hasRegisteredPort(string &name) {
-	for (JackAudioDriver::JackPortMap::iterator e = portMap.begin();
-			e != portMap.end(); ++e) {
-		if (((*e)).first == name) {
-			return true;
+void JackAudioDriver::reapPorts(bool all)
+{
+	unsigned now = __atomic_load_n(&cycles, __ATOMIC_ACQUIRE);
+
+	for(unsigned i = 0; i < retiredPorts.size(); )
+	{
+		// Once a period has finished since it came out of the table, whichever
+		// period might have been using it is over.
+		if(all || retiredPorts[i].cycle != now)
+		{
+			jack_port_unregister(JackAudioDriver::client, retiredPorts[i].port);
+			retiredPorts.erase(retiredPorts.begin() + i);
+		}
+		else
+		{
+			++i;
 		}
 	}
-	return false;
+}
+
+PortHandle JackAudioDriver::findPort(string &name)
+{
+	pthread_mutex_lock(&portLock);
+	PortHandleMap::iterator found = portHandles.find(name);
+	PortHandle handle = (found != portHandles.end())? found->second: NO_PORT;
+	pthread_mutex_unlock(&portLock);
+
+	return handle;
+}
+
+unsigned JackAudioDriver::getFrameTime()
+{
+	return client ? jack_frame_time(client) : 0;
+}
+
+unsigned JackAudioDriver::getPeriodStartTime()
+{
+	return client ? jack_last_frame_time(client) : 0;
+}
+
+bool JackAudioDriver::isProcessThread()
+{
+	return client && pthread_equal(pthread_self(), jack_client_thread_id(client));
 }
 
 AudioDriver::ClientNameList JackAudioDriver::getClientNames()
@@ -243,7 +360,15 @@ bool JackAudioDriver::open(string &name)
   jack_set_buffer_size_callback(client, jackBufferSize, this);
   jack_on_shutdown(client, jackOff, this);
   
-	cout << "jack buffer size: " << jack_get_buffer_size(client) << endl;
+	bufferSize = jack_get_buffer_size(client);
+	cout << "jack buffer size: " << bufferSize << endl;
+
+	// The render threads have to be up before the first process callback.
+	int threads = renderThreads;
+	if(threads < 0)
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+	workers.start(client, (threads > 0) ? (unsigned)threads : 0);
   
   cout << "activate Jack client" << endl;
   if(jack_activate(client))
@@ -253,24 +378,20 @@ bool JackAudioDriver::open(string &name)
   }
 
 	cout << "Register main ports:";
-  left = jack_port_register(client, LEFT_PORT_NAME, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
-  right = jack_port_register(client, RIGHT_PORT_NAME, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+  string leftPort = string(LEFT_PORT_NAME);
+  string rightPort = string(RIGHT_PORT_NAME);
 
-  if((!left) || (!right))
+  // These land in the first two slots: LEFT_PORT and RIGHT_PORT.
+  if(registerPort(leftPort) != LEFT_PORT || registerPort(rightPort) != RIGHT_PORT)
   {
   	cerr << "Error registering one or both of the main ports." << endl;
   	return false;
   }
   
-  portMap[LEFT_PORT_NAME] = left;
-  portMap[RIGHT_PORT_NAME] = right;
-  
   cout << ":ok" << endl;
   
   bool autoConnect = true; // TODO: make an option in the GUI
   if(autoConnect) {
-	  string leftPort = string(LEFT_PORT_NAME);
-	  string rightPort = string(RIGHT_PORT_NAME);
 	  if(!connectMainStereoOut(leftPort, rightPort)) {
 		  cerr << "Error connecting to main stereo outputs";
 	  }
@@ -285,67 +406,92 @@ void JackAudioDriver::onJackShutdown()
 	exit(1);
 }
 
+/** Plays one listener's requests for a period; each request is one piece. */
+struct PlayJob: IParallelJob {
+	IAudioListener *listener;
+	BufferRequestList *requests;
+	float **buffers;
+	unsigned portCount;
+	jack_nframes_t frames;
+
+	void run(unsigned index)
+	{
+		BufferRequest* req = &(*requests)[index];
+		// Create a response for this request (on the stack, so it cleans itself up).
+		BufferResponse response(req, frames);
+
+		PortHandle left = req->getLeftPort();
+		PortHandle right = req->getRightPort();
+
+		if(left >= 0 && (unsigned)left < portCount)
+			response.setLeft(buffers[left]);
+
+		if(right >= 0 && (unsigned)right < portCount)
+			response.setRight(buffers[right]);
+
+		listener->play(&response);
+	}
+};
+
 void JackAudioDriver::process(jack_nframes_t frames)
 {
+	RT_ENTER();
+
 	// Make sure we're up and running
-	if(left && right)
+	if(ports[LEFT_PORT] && ports[RIGHT_PORT])
 	{
+		// Get (and clear) this period's buffer for every port, whether or not
+		// anybody plays into it. Otherwise Jack keeps playing whatever was
+		// left there last time.
+		unsigned count = __atomic_load_n(&portCount, __ATOMIC_ACQUIRE);
+		for(unsigned i = 0; i < count; ++i)
+		{
+			jack_port_t* port = __atomic_load_n(&ports[i], __ATOMIC_ACQUIRE);
+			if(port)
+			{
+				buffers[i] = (sample_t*)jack_port_get_buffer(port, frames);
+				memset(buffers[i], 0, sizeof(sample_t) * frames);
+			}
+			else
+			{
+				buffers[i] = 0;
+			}
+		}
+
+		PlayJob job;
+		job.requests = &requests;
+		job.buffers = buffers;
+		job.portCount = count;
+		job.frames = frames;
+
 		// For each listener
 		for(AudioListenerList::iterator e = listeners.begin(); e != listeners.end(); ++e)
 		{
 			IAudioListener *listener = *e;
 			
 			// See what buffers they want.
-			BufferRequestList requests = listener->getBufferRequests();
-			if(!requests.empty())
+			requests.clear();
+			listener->getBufferRequests(requests, frames);
+
+			// Fill them, spread over the render threads if the listener allows it.
+			job.listener = listener;
+
+			if(listener->playsInParallel())
 			{
-				// For each buffer request
-				for(BufferRequestList::iterator f = requests.begin(); f != requests.end(); ++f)
-				{
-					BufferRequest* req = *f;
-					// Create a response for this request (on the stack, so it cleans itself up).
-					BufferResponse response(req, frames);
-					
-					// Find out which ports they're interested in.
-					BufferRequest::PortNameList ports = req->getPortNames();
-					unsigned idx = 0;
-					for(BufferRequest::PortNameList::iterator g = ports.begin(); g != ports.end(); ++g)
-					{
-						// Get the jack port for this request/port name
-						jack_port_t* jackPort = portMap[*g];
-						// Allocate a buffer for it if found
-						if(jackPort)
-						{
-							sample_t* buf = (sample_t*)jack_port_get_buffer(jackPort, frames);
-							memset(buf, 0, sizeof(sample_t) * frames);
-							
-							response.add(*g, buf);
-							
-							// Make sure we only fill two buffers, since we're stereo.
-							if(idx == 0)
-								response.setLeft(buf);
-							
-							if(idx == 1)
-								response.setRight(buf);
-								
-							if(++idx >= 2)
-								break;
-						}
-					} // for(PortNames...)
-					
-					listener->play(&response);
-					
-				} // for(BufferRequests...)
+				workers.run(job, requests.size());
 			}
+			else
+			{
+				for(unsigned i = 0; i < requests.size(); ++i)
+					job.run(i);
+			}
+
+			listener->playDone();
 		} // for(Listeners...)
 	}
-}
 
-//
-// ------------------- BufferResponse
-//
-BufferResponse::~BufferResponse()
-{
-	if(request)
-		delete request;
+	// Ports retired before now are no longer in use.
+	__atomic_store_n(&cycles, cycles + 1, __ATOMIC_RELEASE);
+
+	RT_LEAVE();
 }
@@ -37,6 +37,9 @@ using namespace std;
 
 #include "model.h"
 #include "config.h"
+#include "sampleloader.h"
+#include "kitcache.h"
+#include "sampleregistry.h"
 
 static string getPath(string& filename)
 {
@@ -67,6 +70,25 @@ static bool toBool(const string & str, bool defValue)
 	return defValue;
 }
 
+static Instrument::Stealing toStealing(const string & str)
+{
+	if(str == "quietest")
+		return Instrument::QUIETEST;
+	if(str == "same-note")
+		return Instrument::SAME_NOTE;
+	return Instrument::OLDEST;
+}
+
+// Empty for the default, so it's left out of the file.
+static string fromStealing(Instrument::Stealing stealing)
+{
+	if(stealing == Instrument::QUIETEST)
+		return "quietest";
+	if(stealing == Instrument::SAME_NOTE)
+		return "same-note";
+	return "";
+}
+
 static string fullPath(string& path, string& filename)
 {
 	string full(path);
@@ -114,7 +136,7 @@ InstrumentInfo::~InstrumentInfo()
 }
 
 // Convert an InstrumentInfo to an Instrument.
-Instrument *InstrumentInfo::toInstrument(int maxSamples, IFileLoadProgressListener * listener)
+Instrument *InstrumentInfo::toInstrument(int maxSamples, IFileLoadProgressListener * listener, SampleLoader * loader)
 {
 	LogPtr log = LogFactory::getLog(__FILE__);
 
@@ -138,24 +160,84 @@ Instrument *InstrumentInfo::toInstrument(int maxSamples, IFileLoadProgressListen
 	for(InstrumentInfo::LayerInfoList::iterator e = layers.begin(); e != layers.end(); ++e)
 	{
 		LayerInfo *layerInfo = *e;
-		string wave = layerInfo->wave;
 		unsigned lo = (unsigned)atoi(layerInfo->lo.c_str());
 		unsigned hi = (unsigned)atoi(layerInfo->hi.c_str());
-		
-		if(listener)
+		InstrumentLayer *layer = 0;
+		bool cancelled = false;
+
+		for(LayerInfo::WaveList::iterator f = layerInfo->waves.begin(); f != layerInfo->waves.end(); ++f)
 		{
-			if(!listener->progressEvent(wave))
-				break;
+			string wave = *f;
+
+			if(listener)
+			{
+				if(!listener->progressEvent(wave))
+				{
+					cancelled = true;
+					break;
+				}
+			}
+
+		  LOG_TRACE(log, "assign " << wave << " to velocity range " << lo << "-" << hi);
+			Sample *sample = loader ? loader->take(wave) : SampleRegistry::acquire(wave, maxSamples);
+			if(sample)
+			{
+				if(layer)
+					layer->add(sample);
+				else
+					layer = new InstrumentLayer(sample, lo, hi);
+			}
 		}
-		
-	  LOG_TRACE(log, "assign " << wave << " to velocity range " << lo << "-" << hi);
-		Sample *sample = Sample::load(wave, maxSamples);
-		if(sample)
+
+		if(layer)
 		{
-			InstrumentLayer *layer = new InstrumentLayer(sample, lo, hi);
+			if(layerInfo->select == "random")
+			{
+				layer->setSelection(InstrumentLayer::RANDOM);
+
+				// Without a seed, go by the file name, so each layer gets its own sequence.
+				unsigned seed = 2166136261u;
+				if(!layerInfo->seed.empty())
+					seed = (unsigned)strtoul(layerInfo->seed.c_str(), 0, 10);
+				else
+					for(string::iterator c = layerInfo->waves[0].begin(); c != layerInfo->waves[0].end(); ++c)
+						seed = (seed ^ (unsigned char)*c) * 16777619u;
+
+				layer->setSeed(seed);
+			}
+
 			inst->add(layer);
-			//sampleMap[sample->getFilename()] = sample;
 		}
+
+		if(cancelled)
+			break;
+	}
+
+	inst->setCrossfade((unsigned)atoi(crossfade.c_str()));
+
+	if(interpolation == "linear")
+		inst->setInterpolation(Instrument::LINEAR);
+	else if(interpolation == "sinc")
+		inst->setInterpolation(Instrument::SINC);
+	else
+		inst->setInterpolation(Instrument::CUBIC);
+
+	inst->setPolyphony((unsigned)atoi(polyphony.c_str()));
+	inst->setRelease(release.empty() ? Instrument::DEFAULT_RELEASE : (unsigned)atoi(release.c_str()));
+	inst->setStealing(toStealing(steal));
+
+	// Better to hear about holes and overlaps now than when a hit goes missing on stage.
+	StringList gaps, overlaps;
+	inst->checkVelocityRanges(gaps, overlaps);
+
+	for(StringList::iterator e = gaps.begin(); e != gaps.end(); ++e)
+	{
+		LOG_WARN(log, "Instrument '" << name << "' has no layer for velocity " << *e);
+	}
+
+	for(StringList::iterator e = overlaps.begin(); e != overlaps.end(); ++e)
+	{
+		LOG_WARN(log, "Instrument '" << name << "' has overlapping layers for velocity " << *e << "; the first one listed plays");
 	}
 
 	return inst;
@@ -171,6 +253,19 @@ InstrumentInfo* InstrumentInfo::from(Instrument* inst)
 	info->pan = toString(inst->getPan());
 	info->pitch = toString(inst->getPitch());
 	info->submix = inst->getSubmixName();
+	if(inst->getCrossfade() > 0)
+		info->crossfade = toString(inst->getCrossfade());
+
+	if(inst->getInterpolation() == Instrument::LINEAR)
+		info->interpolation = "linear";
+	else if(inst->getInterpolation() == Instrument::SINC)
+		info->interpolation = "sinc";
+
+	if(inst->getPolyphony() > 0)
+		info->polyphony = toString(inst->getPolyphony());
+	info->steal = fromStealing(inst->getStealing());
+	if(inst->getRelease() != Instrument::DEFAULT_RELEASE)
+		info->release = toString(inst->getRelease());
 	
 	InstrumentLayerList layers = inst->getLayers();
 	for(InstrumentLayerList::iterator e = layers.begin(); e != layers.end(); ++e)
@@ -189,7 +284,16 @@ LayerInfo* LayerInfo::from(InstrumentLayer *layer)
 	
 	li->hi = toString(layer->getVelocityHI());
 	li->lo = toString(layer->getVelocityLO());
-	li->wave = layer->getSample()->getFilename();
+
+	const SampleList& samples = layer->getSamples();
+	for(SampleList::const_iterator e = samples.begin(); e != samples.end(); ++e)
+		li->waves.push_back((*(e))->getFilename());
+
+	if(layer->getSelection() == InstrumentLayer::RANDOM)
+	{
+		li->select = "random";
+		li->seed = toString(layer->getSeed());
+	}
 	
 	return li;
 }
@@ -204,6 +308,9 @@ Configuration::Configuration(Configuration::SubmixNameList includedSubs)
 bool Configuration::save(const char *filename, Drumkit *dk)
 {
 	kit.name = dk->getName();
+	kit.limiter = dk->hasLimiter();
+	kit.polyphony = dk->getPolyphony();
+	kit.steal = fromStealing(dk->getStealing());
 	
 	InstrumentList instruments = dk->allInstruments();
 	for(InstrumentList::iterator e = instruments.begin(); e != instruments.end(); ++e)
@@ -231,6 +338,12 @@ bool Configuration::save(const char *filename)
 	
 	XMLDocument::Element *drumkit = new XMLDocument::Element("drumkit");
 	drumkit->addAttribute("name", kit.name);
+	if(kit.limiter)
+		drumkit->addAttribute("limiter", toString(kit.limiter));
+	if(kit.polyphony > 0)
+		drumkit->addAttribute("polyphony", toString(kit.polyphony));
+	if(!kit.steal.empty())
+		drumkit->addAttribute("steal", kit.steal);
 	top->add(drumkit);
 	
 	XMLDocument::Element *instruments = new XMLDocument::Element("instruments");
@@ -253,6 +366,21 @@ bool Configuration::save(const char *filename)
 		if(!info->submix.empty())
 			inst->addAttribute("submix", info->submix);
 
+		if(!info->crossfade.empty())
+			inst->addAttribute("crossfade", info->crossfade);
+
+		if(!info->interpolation.empty())
+			inst->addAttribute("interpolation", info->interpolation);
+
+		if(!info->polyphony.empty())
+			inst->addAttribute("polyphony", info->polyphony);
+
+		if(!info->steal.empty())
+			inst->addAttribute("steal", info->steal);
+
+		if(!info->release.empty())
+			inst->addAttribute("release", info->release);
+
 		if(!info->victims.empty())
 		{
 			XMLDocument::Element* victims = new XMLDocument::Element("victims");
@@ -278,7 +406,27 @@ bool Configuration::save(const char *filename)
 
 			li->addAttribute("velLo", layer->lo);
 			li->addAttribute("velHi", layer->hi);
-			li->addAttribute("wave", layer->wave);
+
+			if(!layer->select.empty())
+				li->addAttribute("select", layer->select);
+
+			if(!layer->seed.empty())
+				li->addAttribute("seed", layer->seed);
+
+			// A single take goes in the layer itself; several get an element each.
+			if(layer->waves.size() == 1)
+			{
+				li->addAttribute("wave", layer->waves[0]);
+			}
+			else
+			{
+				for(LayerInfo::WaveList::iterator g = layer->waves.begin(); g != layer->waves.end(); ++g)
+				{
+					XMLDocument::Element *take = new XMLDocument::Element("sample");
+					take->addAttribute("wave", *g);
+					li->add(take);
+				}
+			}
 		}
 	}
 	
@@ -321,13 +469,25 @@ bool Configuration::save(const char *filename)
 
 bool Configuration::load(
 	const char *filename, Drumkit *drumkit
-, bool ignorePorts, int maxSamples, IFileLoadProgressListener * listener)
+, bool ignorePorts, int maxSamples, IFileLoadProgressListener * listener, KitCache * cache)
 {
-	if(!load(filename, listener))
+	if(cache && cache->open() && cache->read(*this))
+	{
+		if(listener)
+		{
+			string msg = "Load ";
+			msg += filename;
+			listener->progressEvent(msg);
+		}
+	}
+	else if(!load(filename, listener))
 		return false;
 
 	drumkit->setName(kit.name);
 	drumkit->setLevel(kit.level);
+	drumkit->setLimiter(kit.limiter);
+	drumkit->setPolyphony(kit.polyphony);
+	drumkit->setStealing(toStealing(kit.steal));
 	drumkit->setSelectedSceneName(kit.selectedScene);
 	
 	// Filter out those instruments not in any of the included submixes
@@ -369,11 +529,37 @@ bool Configuration::load(
 		kit.instruments = list;
 	}
 
+	// Decode the samples on as many threads as the machine has. The instruments
+	// are still built one at a time, in order, as their samples come in.
+	SampleLoader loader(maxSamples);
+
+	for(KitInfo::InstrumentInfoList::iterator e = kit.instruments.begin(); e != kit.instruments.end(); ++e)
+	{
+		for(InstrumentInfo::LayerInfoList::iterator f = (*e)->layers.begin(); f != (*e)->layers.end(); ++f)
+		{
+			for(LayerInfo::WaveList::iterator g = (*f)->waves.begin(); g != (*f)->waves.end(); ++g)
+			{
+				// Waves already in memory (for the kit we're replacing, say) are
+				// shared rather than loaded again.
+				Sample *shared = SampleRegistry::acquireResident(*g, maxSamples);
+				if(!shared && cache)
+					shared = SampleRegistry::adopt(cache->take(*g), maxSamples);
+
+				if(shared)
+					loader.add(*g, shared);
+				else
+					loader.add(*g);
+			}
+		}
+	}
+
+	loader.start();
+
 	for(KitInfo::InstrumentInfoList::iterator e = kit.instruments.begin(); e != kit.instruments.end(); ++e)
 	{
 		InstrumentInfo *info = *e;
 		
-		Instrument* inst = info->toInstrument(maxSamples);
+		Instrument* inst = info->toInstrument(maxSamples, 0, &loader);
 		if(inst)
 			drumkit->add((unsigned)atoi(info->noteNumber.c_str()), inst);
 			
@@ -429,6 +615,13 @@ bool Configuration::load(
 			}
 		}
 	}
+
+	// The audio thread works with choke groups rather than the victim lists.
+	if(!drumkit->buildChokeGroups())
+	{
+		LogPtr log = LogFactory::getLog(__FILE__);
+		LOG_WARN(log, "The victims need more than " << Drumkit::MAX_CHOKE_GROUPS << " choke groups; some of them won't be choked");
+	}
 	
 	InstrumentList allInst = drumkit->allInstruments();
 	
@@ -530,6 +723,9 @@ bool Configuration::load(const char *filename, IFileLoadProgressListener * liste
 			lvl = 100;
 			
 		kit.level = lvl;
+		kit.limiter = toBool(drumkit->getAttributeValue("limiter"), false);
+		kit.polyphony = (unsigned)atoi(drumkit->getAttributeValue("polyphony").c_str());
+		kit.steal = drumkit->getAttributeValue("steal");
 		
 		XMLDocument::Element *instruments = drumkit->findElement("instruments");
 		
@@ -551,6 +747,11 @@ bool Configuration::load(const char *filename, IFileLoadProgressListener * liste
 			info->level = elem->getAttributeValue("level");
 			info->pan = elem->getAttributeValue("pan");
 			info->pitch = elem->getAttributeValue("pitch");
+			info->crossfade = elem->getAttributeValue("crossfade");
+			info->interpolation = elem->getAttributeValue("interpolation");
+			info->polyphony = elem->getAttributeValue("polyphony");
+			info->steal = elem->getAttributeValue("steal");
+			info->release = elem->getAttributeValue("release");
 			
 			XMLDocument::Element* layers = elem->findElement("layers");
 			if(layers)
@@ -565,18 +766,29 @@ bool Configuration::load(const char *filename, IFileLoadProgressListener * liste
 					
 					linfo->lo = layer->getAttributeValue("velLo");
 					linfo->hi = layer->getAttributeValue("velHi");
-					linfo->wave = layer->getAttributeValue("wave");
-					
-					string wv = linfo->wave;
-					
-					if(!isAbsolutePath(wv))
-						linfo->wave = fullPath(filePath, wv);
-					
-					// Make sure the sample file exists
-					std::ifstream verify(linfo->wave.c_str(), std::ios::in | std::ios::binary);
-					if(verify == NULL)
+					linfo->select = layer->getAttributeValue("select");
+					linfo->seed = layer->getAttributeValue("seed");
+
+					// The layer's own "wave", then any <sample wave="..."/> takes inside it.
+					string wv = layer->getAttributeValue("wave");
+					if(!wv.empty())
+						linfo->waves.push_back(wv);
+
+					XMLDocument::Element::List takes = layer->getElements("sample");
+					for(XMLDocument::Element::List::iterator g = takes.begin(); g != takes.end(); ++g)
+						linfo->waves.push_back((*(g))->getAttributeValue("wave"));
+
+					for(LayerInfo::WaveList::iterator g = linfo->waves.begin(); g != linfo->waves.end(); ++g)
 					{
-						LOG_WARN(log, "Sample file not found: " << linfo->wave);
+						if(!isAbsolutePath(*g))
+							*g = fullPath(filePath, *g);
+
+						// Make sure the sample file exists
+						std::ifstream verify(g->c_str(), std::ios::in | std::ios::binary);
+						if(verify == NULL)
+						{
+							LOG_WARN(log, "Sample file not found: " << *g);
+						}
 					}
 
 					info->layers.push_back(linfo);
@@ -0,0 +1,330 @@
+// diskstream.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <sndfile.h>
+
+using namespace std;
+
+#include "diskstream.h"
+#include "model.h"
+#include "log.h"
+
+static const unsigned RING_MASK = DiskStreamer::RING_FRAMES - 1;
+
+unsigned DiskStreamer::preload = 0;
+
+unsigned DiskStreamer::preloadFrames(unsigned rate)
+{
+	unsigned frames = (unsigned)((unsigned long long)preload * rate / 1000);
+	if(frames < MIN_PRELOAD_FRAMES)
+		frames = MIN_PRELOAD_FRAMES;
+
+	return frames;
+}
+
+DiskStreamer::DiskStreamer()
+: streams(0)
+, buffer(0)
+, bufferChannels(0)
+, running(false)
+, quit(false)
+, underruns(0)
+{
+	sem_init(&wakeup, 0, 0);
+}
+
+DiskStreamer::~DiskStreamer()
+{
+	stop();
+	sem_destroy(&wakeup);
+}
+
+bool DiskStreamer::start()
+{
+	if(running)
+		return true;
+
+	LogPtr log = LogFactory::getLog(__FILE__);
+
+	streams = new Stream[MAX_STREAMS];
+	for(unsigned i = 0; i < MAX_STREAMS; ++i)
+	{
+		Stream &stream = streams[i];
+		stream.state = IDLE;
+		stream.path[0] = 0;
+		stream.start = stream.end = 0;
+		stream.written = stream.consumed = 0;
+		stream.left = new float[RING_FRAMES + MIRROR_FRAMES];
+		stream.right = new float[RING_FRAMES + MIRROR_FRAMES];
+		stream.file = 0;
+		stream.opened = false;
+		stream.channels = 0;
+	}
+
+	quit = false;
+	if(pthread_create(&thread, 0, threadMain, this) != 0)
+	{
+		LOG_WARN(log, "DiskStreamer::start: can't start the I/O thread" << endl);
+		for(unsigned i = 0; i < MAX_STREAMS; ++i)
+		{
+			delete[] streams[i].left;
+			delete[] streams[i].right;
+		}
+		delete[] streams;
+		streams = 0;
+		return false;
+	}
+
+	__atomic_store_n(&running, true, __ATOMIC_RELEASE);
+	LOG_TRACE(log, "DiskStreamer::start: streaming past the first " << preload << " ms of each sample" << endl);
+	return true;
+}
+
+void DiskStreamer::stop()
+{
+	if(!running)
+		return;
+
+	__atomic_store_n(&quit, true, __ATOMIC_RELEASE);
+	sem_post(&wakeup);
+	pthread_join(thread, 0);
+	running = false;
+
+	for(unsigned i = 0; i < MAX_STREAMS; ++i)
+	{
+		closeFile(streams[i]);
+		delete[] streams[i].left;
+		delete[] streams[i].right;
+	}
+	delete[] streams;
+	streams = 0;
+
+	delete[] buffer;
+	buffer = 0;
+	bufferChannels = 0;
+}
+
+int DiskStreamer::open(const Sample *sample)
+{
+	if(!isRunning() || !sample->isStreamed())
+		return -1;
+
+	const string &filename = sample->getFilename();
+	if(filename.length() >= PATH_MAX)
+		return -1;
+
+	for(unsigned i = 0; i < MAX_STREAMS; ++i)
+	{
+		Stream &stream = streams[i];
+		if(__atomic_load_n(&stream.state, __ATOMIC_ACQUIRE) != IDLE)
+			continue;
+
+		memcpy(stream.path, filename.c_str(), filename.length() + 1);
+		stream.start = seamFor(sample->frames) - TAPS;
+		stream.end = sample->totalFrames;
+		stream.written = 0;
+		stream.consumed = 0;
+		__atomic_store_n(&stream.state, (int)OPENING, __ATOMIC_RELEASE);
+
+		sem_post(&wakeup);
+		return i;
+	}
+
+	return -1;
+}
+
+void DiskStreamer::close(int stream)
+{
+	__atomic_store_n(&streams[stream].state, (int)CLOSING, __ATOMIC_RELEASE);
+}
+
+bool DiskStreamer::read(int stream, unsigned first, unsigned count, const float *&left, const float *&right)
+{
+	Stream &s = streams[stream];
+	unsigned offset = first - s.start;
+
+	if(offset + count > __atomic_load_n(&s.written, __ATOMIC_ACQUIRE))
+	{
+		__atomic_add_fetch(&underruns, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	left = s.left + (offset & RING_MASK);
+	right = s.right + (offset & RING_MASK);
+	return true;
+}
+
+void DiskStreamer::release(int stream, unsigned frame)
+{
+	Stream &s = streams[stream];
+	if(frame <= s.start + TAPS)
+		return;
+
+	unsigned consumed = frame - TAPS - s.start;
+	if(consumed > s.consumed)
+		__atomic_store_n(&s.consumed, consumed, __ATOMIC_RELEASE);
+}
+
+void DiskStreamer::wake()
+{
+	sem_post(&wakeup);
+}
+
+unsigned DiskStreamer::getUnderruns() const
+{
+	return __atomic_load_n(&underruns, __ATOMIC_RELAXED);
+}
+
+void* DiskStreamer::threadMain(void *arg)
+{
+	((DiskStreamer*)arg)->run();
+	return 0;
+}
+
+void DiskStreamer::run()
+{
+	while(true)
+	{
+		sem_wait(&wakeup);
+		if(__atomic_load_n(&quit, __ATOMIC_ACQUIRE))
+			break;
+
+		// Go round the streams a chunk at a time, so a new stream that needs
+		// filling all the way doesn't hold up ones that are about to run dry.
+		bool busy = true;
+		while(busy && !__atomic_load_n(&quit, __ATOMIC_ACQUIRE))
+		{
+			busy = false;
+			for(unsigned i = 0; i < MAX_STREAMS; ++i)
+			{
+				Stream &stream = streams[i];
+				int state = __atomic_load_n(&stream.state, __ATOMIC_ACQUIRE);
+
+				if(state == CLOSING)
+				{
+					closeFile(stream);
+					__atomic_store_n(&stream.state, (int)IDLE, __ATOMIC_RELEASE);
+				}
+				else if(state == OPENING || state == PLAYING)
+				{
+					if(fill(stream))
+						busy = true;
+				}
+			}
+		}
+	}
+}
+
+// Read the next chunk of a stream, if there's room for it. False if there's
+// nothing more to do for it for now.
+bool DiskStreamer::fill(Stream &stream)
+{
+	if(!stream.opened)
+	{
+		LogPtr log = LogFactory::getLog(__FILE__);
+		stream.opened = true;
+		stream.channels = 1;
+
+		SF_INFO info;
+		memset(&info, 0, sizeof(info));
+		SNDFILE *file = sf_open(stream.path, SFM_READ, &info);
+		if(!file)
+		{
+			LOG_WARN(log, "DiskStreamer::fill: can't open " << stream.path << endl);
+		}
+		else if(sf_seek(file, stream.start, SEEK_SET) < 0)
+		{
+			LOG_WARN(log, "DiskStreamer::fill: can't seek in " << stream.path << endl);
+			sf_close(file);
+		}
+		else
+		{
+			stream.file = file;
+			stream.channels = info.channels;
+		}
+
+		// Unless the audio thread closed it in the meantime.
+		int opening = OPENING;
+		__atomic_compare_exchange_n(&stream.state, &opening, (int)PLAYING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+
+	unsigned written = stream.written;
+	unsigned limit = __atomic_load_n(&stream.consumed, __ATOMIC_ACQUIRE) + RING_FRAMES;
+	if(limit > stream.end - stream.start)
+		limit = stream.end - stream.start;
+
+	if(written >= limit)
+		return false;
+
+	unsigned count = limit - written;
+	if(count > CHUNK_FRAMES)
+		count = CHUNK_FRAMES;
+
+	if(stream.channels > bufferChannels)
+	{
+		delete[] buffer;
+		buffer = new float[CHUNK_FRAMES * stream.channels];
+		bufferChannels = stream.channels;
+	}
+
+	sf_count_t got = 0;
+	if(stream.file)
+		got = sf_readf_float((SNDFILE*)stream.file, buffer, count);
+	if(got < 0)
+		got = 0;
+
+	// A file that won't open, or is shorter than it was when it was loaded,
+	// plays out as silence.
+	memset(buffer + got * stream.channels, 0, (count - got) * stream.channels * sizeof(float));
+
+	unsigned channels = stream.channels;
+	unsigned second = channels > 1 ? 1 : 0;
+	for(unsigned i = 0; i < count; ++i)
+	{
+		unsigned index = (written + i) & RING_MASK;
+		float left = buffer[i * channels];
+		float right = buffer[i * channels + second];
+
+		stream.left[index] = left;
+		stream.right[index] = right;
+		if(index < MIRROR_FRAMES)
+		{
+			stream.left[index + RING_FRAMES] = left;
+			stream.right[index + RING_FRAMES] = right;
+		}
+	}
+
+	__atomic_store_n(&stream.written, written + count, __ATOMIC_RELEASE);
+	return true;
+}
+
+void DiskStreamer::closeFile(Stream &stream)
+{
+	if(stream.file)
+	{
+		sf_close((SNDFILE*)stream.file);
+		stream.file = 0;
+	}
+
+	stream.opened = false;
+}
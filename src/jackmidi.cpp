@@ -0,0 +1,171 @@
+// jackmidi.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+#include <iostream>
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+using namespace std;
+
+#include "jackmidi.h"
+
+const char* JackMidiDriver::PORT_NAME = "midi_in";
+
+JackMidiDriver::JackMidiDriver()
+: input(0)
+{
+}
+
+JackMidiDriver::~JackMidiDriver()
+{
+	if(input)
+	{
+		close();
+	}
+}
+
+/** Register our input port with the (already open) Jack client. */
+void JackMidiDriver::open(string &name)
+{
+	clientName = name;
+
+	if(!JackAudioDriver::client)
+	{
+		cerr << "JackMidiDriver::open(): Jack isn't running." << endl;
+		return;
+	}
+
+	jack_port_t *port = jack_port_register(JackAudioDriver::client, PORT_NAME, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+	if(!port)
+	{
+		cerr << "Unable to register Jack MIDI port " << PORT_NAME << endl;
+		return;
+	}
+
+	__atomic_store_n(&input, port, __ATOMIC_RELEASE);
+
+	if(!connectPortName.empty())
+	{
+		string target = jack_port_name(port);
+		connectPort(connectPortName, target);
+	}
+}
+
+void JackMidiDriver::close()
+{
+	jack_port_t *port = input;
+	__atomic_store_n(&input, (jack_port_t*)0, __ATOMIC_RELEASE);
+
+	if(port && JackAudioDriver::client)
+	{
+		jack_port_unregister(JackAudioDriver::client, port);
+	}
+}
+
+PortList JackMidiDriver::getOutputPortList()
+{
+	PortList list;
+
+	if(!JackAudioDriver::client)
+	{
+		return list;
+	}
+
+	const char ** ports = jack_get_ports(JackAudioDriver::client, 0, JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput);
+	for(int i = 0; ports && ports[i]; ++i)
+	{
+		list.push_back(string(ports[i]));
+	}
+
+	if(ports)
+	{
+		jack_free(ports);
+	}
+
+	return list;
+}
+
+void JackMidiDriver::connectPort(string &port, string &target)
+{
+	if(!JackAudioDriver::client || jack_connect(JackAudioDriver::client, port.c_str(), target.c_str()))
+	{
+		cerr << "Unable to connect to the specified MIDI port: " << port << endl;
+	}
+}
+
+/** Read this period's events and pass them on, with their frame offsets.
+	This is on the process thread, so the listeners mustn't block or allocate.
+	*/
+void JackMidiDriver::getBufferRequests(BufferRequestList&, unsigned frames)
+{
+	jack_port_t *port = __atomic_load_n(&input, __ATOMIC_ACQUIRE);
+	if(!port || !active)
+	{
+		return;
+	}
+
+	void *buffer = jack_port_get_buffer(port, frames);
+	unsigned count = jack_midi_get_event_count(buffer);
+
+	for(unsigned i = 0; i < count; ++i)
+	{
+		jack_midi_event_t event;
+		if(jack_midi_event_get(&event, buffer, i) || event.size < 3)
+		{
+			continue;
+		}
+
+		MidiMessage msg;
+		msg.channel = event.buffer[0] & 0x0f;
+		msg.data1 = event.buffer[1];
+		msg.data2 = event.buffer[2];
+		msg.frame = (int)event.time;
+
+		switch(event.buffer[0] & 0xf0)
+		{
+			case 0x90:
+				msg.type = MidiMessage::NOTE_ON;
+				break;
+
+			case 0x80:
+				msg.type = MidiMessage::NOTE_OFF;
+				break;
+
+			case 0xa0:
+				msg.type = MidiMessage::POLYPHONIC_KEY_PRESSURE;
+				break;
+
+			case 0xb0:
+				msg.type = MidiMessage::CONTROL_CHANGE;
+				break;
+
+			case 0xe0:
+				msg.type = MidiMessage::PITCH_WHEEL;
+				break;
+
+			default:
+				continue;
+		}
+
+		handleMidiMessage(msg);
+	}
+}
@@ -0,0 +1,862 @@
+// kitcache.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+using namespace std;
+
+#include "kitcache.h"
+#include "model.h"
+#include "config.h"
+#include "log.h"
+#include "sampleregistry.h"
+#include "samplestore.h"
+
+static const char KIT_CACHE_MAGIC[8] = { 'S', 'D', 'D', 'M', 'K', 'I', 'T', 0 };
+static const uint32_t KIT_CACHE_VERSION = 1;
+
+/// Every wave starts on a page of its own, so it can be mapped by itself.
+static const uint64_t KIT_CACHE_PAGE = 4096;
+
+/// A stereo wave's right channel starts on a cache line.
+static const uint64_t KIT_CACHE_PLANE_ALIGN = 64;
+
+static const uint64_t HASH_SEED = 14695981039346656037ULL;
+static const uint64_t HASH_PRIME = 1099511628211ULL;
+
+/** The start of a compiled kit. The serialized configuration follows it, then
+	"waveCount" KitCacheWaves, each followed by the wave's path. The waves' data
+	starts on the next page. */
+struct KitCacheHeader {
+	char magic[8];
+	uint32_t version;
+	int32_t maxSamples;
+	uint64_t kitSize;
+	int64_t kitModified;
+	int64_t kitModifiedNanos;
+	uint64_t kitHash;		///< Of the kit file's contents.
+	uint64_t configLength;
+	uint32_t waveCount;
+	uint32_t reserved;
+	uint64_t metaLength;	///< The header, configuration and wave table.
+	uint64_t metaHash;		///< Of everything in the metadata after the header.
+	uint64_t length;		///< Of the whole file.
+};
+
+struct KitCacheWave {
+	uint64_t sourceSize;
+	int64_t sourceModified;
+	int64_t sourceModifiedNanos;
+	uint64_t offset;		///< Page aligned.
+	uint64_t length;		///< A whole number of pages.
+	uint64_t left;			///< Relative to "offset".
+	uint64_t right;			///< The same as "left" for a mono wave.
+	uint64_t hash;			///< Of the left channel, then the right if there is one.
+	uint32_t frames;
+	uint32_t sampleRate;
+	uint32_t pathLength;
+	uint32_t reserved;
+};
+
+// 64-bit FNV-1a, eight bytes at a time, so checking a big kit doesn't take long.
+static uint64_t hashBytes(const void *data, size_t length, uint64_t hash = HASH_SEED)
+{
+	const char *p = (const char*)data;
+
+	for(; length >= sizeof(uint64_t); length -= sizeof(uint64_t), p += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		hash = (hash ^ word) * HASH_PRIME;
+	}
+
+	for(; length > 0; --length, ++p)
+		hash = (hash ^ (unsigned char)*p) * HASH_PRIME;
+
+	return hash;
+}
+
+static uint64_t roundUp(uint64_t n, uint64_t to)
+{
+	return (n + to - 1) / to * to;
+}
+
+static bool readFile(const string &filename, string &contents)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	contents.clear();
+
+	char buffer[16384];
+	ssize_t n;
+	while((n = read(fd, buffer, sizeof(buffer))) > 0)
+		contents.append(buffer, n);
+
+	close(fd);
+	return n == 0;
+}
+
+// Make "path" and any directories above it that aren't there yet.
+static bool makeDirectories(const string &path)
+{
+	for(string::size_type slash = path.find('/', 1); ; slash = path.find('/', slash + 1))
+	{
+		string dir = path.substr(0, slash);
+		if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+			return false;
+
+		if(slash == string::npos)
+			return true;
+	}
+}
+
+static bool writeAt(int fd, const void *data, size_t length, uint64_t offset)
+{
+	const char *p = (const char*)data;
+
+	while(length > 0)
+	{
+		ssize_t written = pwrite(fd, p, length, offset);
+		if(written <= 0)
+			return false;
+
+		p += written;
+		offset += written;
+		length -= written;
+	}
+
+	return true;
+}
+
+//
+//----------------Serializing the configuration
+//
+static void put(string &out, uint32_t value)
+{
+	out.append((const char*)&value, sizeof(value));
+}
+
+static void put(string &out, const string &value)
+{
+	put(out, (uint32_t)value.length());
+	out.append(value);
+}
+
+static void put(string &out, const vector<string> &values)
+{
+	put(out, (uint32_t)values.size());
+	for(vector<string>::const_iterator e = values.begin(); e != values.end(); ++e)
+		put(out, *e);
+}
+
+/// Reads back what put() wrote. Once anything runs off the end, everything fails.
+struct ConfigReader {
+	const char *p;
+	const char *end;
+	bool ok;
+
+	ConfigReader(const string &in)
+	: p(in.data())
+	, end(in.data() + in.length())
+	, ok(true)
+	{}
+
+	uint32_t number()
+	{
+		uint32_t value = 0;
+		if(ok && (size_t)(end - p) >= sizeof(value))
+		{
+			memcpy(&value, p, sizeof(value));
+			p += sizeof(value);
+		}
+		else
+			ok = false;
+
+		return value;
+	}
+
+	string text()
+	{
+		uint32_t length = number();
+		if(!ok || (size_t)(end - p) < length)
+		{
+			ok = false;
+			return string();
+		}
+
+		string value(p, length);
+		p += length;
+		return value;
+	}
+
+	void list(vector<string> &values)
+	{
+		uint32_t count = number();
+		for(uint32_t i = 0; ok && i < count; ++i)
+			values.push_back(text());
+	}
+};
+
+static string serialize(Configuration &conf)
+{
+	string out;
+	KitInfo &kit = conf.kit;
+
+	put(out, conf.portNames);
+
+	put(out, kit.name);
+	put(out, kit.level);
+	put(out, kit.limiter ? 1 : 0);
+	put(out, kit.polyphony);
+	put(out, kit.steal);
+	put(out, kit.selectedScene);
+	put(out, kit.getSubmixes());
+
+	put(out, (uint32_t)kit.instruments.size());
+	for(KitInfo::InstrumentInfoList::iterator e = kit.instruments.begin(); e != kit.instruments.end(); ++e)
+	{
+		InstrumentInfo *info = *e;
+
+		put(out, info->noteNumber);
+		put(out, info->name);
+		put(out, info->submix);
+		put(out, info->level);
+		put(out, info->pan);
+		put(out, info->pitch);
+		put(out, info->crossfade);
+		put(out, info->interpolation);
+		put(out, info->polyphony);
+		put(out, info->steal);
+		put(out, info->release);
+		put(out, info->victims);
+
+		put(out, (uint32_t)info->layers.size());
+		for(InstrumentInfo::LayerInfoList::iterator f = info->layers.begin(); f != info->layers.end(); ++f)
+		{
+			put(out, (*f)->lo);
+			put(out, (*f)->hi);
+			put(out, (*f)->select);
+			put(out, (*f)->seed);
+			put(out, (*f)->waves);
+		}
+	}
+
+	put(out, (uint32_t)kit.scenes.size());
+	for(KitInfo::SceneInfoList::iterator e = kit.scenes.begin(); e != kit.scenes.end(); ++e)
+	{
+		put(out, (*e)->name);
+
+		put(out, (uint32_t)(*e)->settings.size());
+		for(SceneInfo::SettingInfoList::iterator f = (*e)->settings.begin(); f != (*e)->settings.end(); ++f)
+		{
+			SceneSettingInfo *setting = *f;
+
+			put(out, setting->instrumentName);
+			put(out, (uint32_t)setting->level);
+			put(out, (uint32_t)setting->pan);
+			put(out, (uint32_t)setting->pitch);
+			put(out, setting->mute ? 1 : 0);
+			put(out, setting->solo ? 1 : 0);
+		}
+	}
+
+	return out;
+}
+
+static bool deserialize(const string &in, Configuration &conf)
+{
+	ConfigReader reader(in);
+	KitInfo &kit = conf.kit;
+
+	reader.list(conf.portNames);
+
+	kit.name = reader.text();
+	kit.level = reader.number();
+	kit.limiter = reader.number() != 0;
+	kit.polyphony = reader.number();
+	kit.steal = reader.text();
+	kit.selectedScene = reader.text();
+
+	vector<string> submixes;
+	reader.list(submixes);
+	for(vector<string>::iterator e = submixes.begin(); e != submixes.end(); ++e)
+		kit.addSubmix(*e);
+
+	uint32_t instruments = reader.number();
+	for(uint32_t i = 0; reader.ok && i < instruments; ++i)
+	{
+		InstrumentInfo *info = new InstrumentInfo();
+		kit.instruments.push_back(info);
+
+		info->noteNumber = reader.text();
+		info->name = reader.text();
+		info->submix = reader.text();
+		info->level = reader.text();
+		info->pan = reader.text();
+		info->pitch = reader.text();
+		info->crossfade = reader.text();
+		info->interpolation = reader.text();
+		info->polyphony = reader.text();
+		info->steal = reader.text();
+		info->release = reader.text();
+		reader.list(info->victims);
+
+		uint32_t layers = reader.number();
+		for(uint32_t j = 0; reader.ok && j < layers; ++j)
+		{
+			LayerInfo *layer = new LayerInfo();
+			info->layers.push_back(layer);
+
+			layer->lo = reader.text();
+			layer->hi = reader.text();
+			layer->select = reader.text();
+			layer->seed = reader.text();
+			reader.list(layer->waves);
+		}
+	}
+
+	uint32_t scenes = reader.number();
+	for(uint32_t i = 0; reader.ok && i < scenes; ++i)
+	{
+		SceneInfo *scene = new SceneInfo();
+		kit.scenes.push_back(scene);
+
+		scene->name = reader.text();
+
+		uint32_t settings = reader.number();
+		for(uint32_t j = 0; reader.ok && j < settings; ++j)
+		{
+			SceneSettingInfo *setting = new SceneSettingInfo();
+			scene->settings.push_back(setting);
+
+			setting->instrumentName = reader.text();
+			setting->level = (int)reader.number();
+			setting->pan = (int)reader.number();
+			setting->pitch = (int)reader.number();
+			setting->mute = reader.number() != 0;
+			setting->solo = reader.number() != 0;
+		}
+	}
+
+	return reader.ok && reader.p == reader.end;
+}
+
+//
+//----------------KitCache
+//
+bool KitCache::verify = false;
+pthread_mutex_t KitCache::writerLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t KitCache::writer;
+bool KitCache::writerStarted = false;
+bool KitCache::writerBusy = false;
+
+KitCache::KitCache(const string &kitFile, int maxSamples)
+: kitFile(kitFile)
+, cacheFile(pathFor(kitFile))
+, maxSamples(maxSamples)
+, fd(-1)
+, stale(true)
+{}
+
+KitCache::~KitCache()
+{
+	if(fd >= 0)
+		close(fd);
+}
+
+string KitCache::pathFor(const string &kitFile)
+{
+	// Kit directories are often read-only, or shared, so keep compiled kits
+	// with the decoded samples, or in the user's cache.
+	string dir;
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+
+	if(SampleStore::isEnabled())
+		dir = SampleStore::getDirectory();
+	else if(xdg && *xdg)
+		dir = string(xdg) + "/sddm";
+	else if(home && *home)
+		dir = string(home) + "/.cache/sddm";
+	else
+		return string();
+
+	// Named after the kit, and a hash (64-bit FNV-1a) of its full path, so two
+	// kits called kit.xml don't collide.
+	string path = SampleRegistry::canonicalPath(kitFile);
+	uint64_t hash = hashBytes(path.data(), path.length());
+
+	string name = path.substr(path.rfind('/') + 1);
+	string::size_type dot = name.rfind('.');
+	if(dot != string::npos && dot > 0)
+		name.erase(dot);
+
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "-%016llx.sddmkit", (unsigned long long)hash);
+
+	return dir + "/" + name + suffix;
+}
+
+bool KitCache::open()
+{
+	stale = true;
+	entries.clear();
+	config.clear();
+
+	if(fd >= 0)
+		close(fd);
+
+	struct stat kitStat;
+	if(cacheFile.empty() || stat(kitFile.c_str(), &kitStat) != 0)
+		return false;
+
+	fd = ::open(cacheFile.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	KitCacheHeader header;
+	struct stat cacheStat;
+	string contents;
+
+	bool valid = fstat(fd, &cacheStat) == 0
+		&& pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+		&& memcmp(header.magic, KIT_CACHE_MAGIC, sizeof(KIT_CACHE_MAGIC)) == 0
+		&& header.version == KIT_CACHE_VERSION
+		&& header.maxSamples == maxSamples
+		&& header.kitSize == (uint64_t)kitStat.st_size
+		&& header.kitModified == (int64_t)kitStat.st_mtim.tv_sec
+		&& header.kitModifiedNanos == (int64_t)kitStat.st_mtim.tv_nsec
+		&& header.length == (uint64_t)cacheStat.st_size
+		&& header.metaLength >= sizeof(header) + header.configLength
+		&& header.metaLength <= header.length
+		&& readFile(kitFile, contents)
+		&& hashBytes(contents.data(), contents.length()) == header.kitHash;
+
+	string meta;
+	if(valid)
+	{
+		meta.resize(header.metaLength - sizeof(header));
+		valid = pread(fd, &meta[0], meta.length(), sizeof(header)) == (ssize_t)meta.length()
+			&& hashBytes(meta.data(), meta.length()) == header.metaHash;
+	}
+
+	if(valid)
+	{
+		config = meta.substr(0, header.configLength);
+
+		// Every wave has to be just as it was when the kit was compiled.
+		uint64_t at = header.configLength;
+		for(uint32_t i = 0; valid && i < header.waveCount; ++i)
+		{
+			KitCacheWave wave;
+			valid = at + sizeof(wave) <= meta.length();
+			if(!valid)
+				break;
+
+			memcpy(&wave, meta.data() + at, sizeof(wave));
+			at += sizeof(wave);
+
+			valid = at + wave.pathLength <= meta.length();
+			if(!valid)
+				break;
+
+			string path = meta.substr(at, wave.pathLength);
+			at += wave.pathLength;
+
+			struct stat waveStat;
+			valid = stat(path.c_str(), &waveStat) == 0
+				&& wave.sourceSize == (uint64_t)waveStat.st_size
+				&& wave.sourceModified == (int64_t)waveStat.st_mtim.tv_sec
+				&& wave.sourceModifiedNanos == (int64_t)waveStat.st_mtim.tv_nsec
+				&& wave.offset % KIT_CACHE_PAGE == 0
+				&& wave.offset + wave.length <= header.length
+				&& wave.left + (uint64_t)wave.frames * sizeof(float) <= wave.length
+				&& wave.right + (uint64_t)wave.frames * sizeof(float) <= wave.length;
+
+			Entry &entry = entries[path];
+			entry.offset = wave.offset;
+			entry.length = wave.length;
+			entry.left = wave.left;
+			entry.right = wave.right;
+			entry.hash = wave.hash;
+			entry.frames = wave.frames;
+			entry.sampleRate = wave.sampleRate;
+		}
+	}
+
+	if(!valid)
+	{
+		entries.clear();
+		config.clear();
+		close(fd);
+		fd = -1;
+		return false;
+	}
+
+	stale = false;
+	return true;
+}
+
+bool KitCache::read(Configuration &conf)
+{
+	if(fd < 0)
+		return false;
+
+	// Read it into a configuration of our own, so a bad one leaves "conf" alone.
+	Configuration compiled;
+	if(!deserialize(config, compiled))
+	{
+		stale = true;
+		return false;
+	}
+
+	KitInfo &kit = conf.kit;
+	conf.portNames.swap(compiled.portNames);
+	kit.name = compiled.kit.name;
+	kit.level = compiled.kit.level;
+	kit.limiter = compiled.kit.limiter;
+	kit.polyphony = compiled.kit.polyphony;
+	kit.steal = compiled.kit.steal;
+	kit.selectedScene = compiled.kit.selectedScene;
+	kit.getSubmixes().swap(compiled.kit.getSubmixes());
+	kit.instruments.swap(compiled.kit.instruments);
+	kit.scenes.swap(compiled.kit.scenes);
+
+	return true;
+}
+
+Sample* KitCache::take(const string &filename)
+{
+	if(fd < 0)
+		return 0;
+
+	EntryMap::iterator e = entries.find(SampleRegistry::canonicalPath(filename));
+	if(e == entries.end())
+		return 0;
+
+	const Entry &entry = e->second;
+
+	// Fault it all in now, rather than on the process thread when it first plays.
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+
+	void *mapping = mmap(0, entry.length, PROT_READ, flags, fd, entry.offset);
+	if(mapping == MAP_FAILED)
+		return 0;
+
+	const float *left = (const float*)((const char*)mapping + entry.left);
+	const float *right = (const float*)((const char*)mapping + entry.right);
+
+	// The metadata, and each wave's size and modification time, have already
+	// checked out. Hashing the data as well means reading all of it.
+	if(verify)
+	{
+		size_t planeLength = (size_t)entry.frames * sizeof(float);
+
+		uint64_t hash = hashBytes(left, planeLength);
+		if(right != left)
+			hash = hashBytes(right, planeLength, hash);
+
+		if(hash != entry.hash)
+		{
+			LogPtr log = LogFactory::getLog(__FILE__);
+			LOG_WARN(log, "Compiled copy of " << filename << " is damaged; loading the wave instead");
+
+			munmap(mapping, entry.length);
+			stale = true;
+			return 0;
+		}
+	}
+
+	Sample *sample = new Sample(entry.frames, filename);
+	sample->sampleRate = entry.sampleRate;
+	sample->dataL = (float*)left;
+	sample->dataR = (float*)right;
+	sample->mapping = mapping;
+	sample->mappingLength = entry.length;
+
+	return sample;
+}
+
+bool KitCache::write(Configuration &conf, Drumkit &drumkit)
+{
+	Job *job = prepare(conf, drumkit);
+	if(!job)
+		return false;
+
+	bool ok = run(*job);
+	finish(job);
+	return ok;
+}
+
+bool KitCache::writeLater(Configuration &conf, Drumkit &drumkit)
+{
+	pthread_mutex_lock(&writerLock);
+
+	// One kit at a time. This one's still stale, so it'll be written next time.
+	if(writerBusy)
+	{
+		pthread_mutex_unlock(&writerLock);
+		return false;
+	}
+
+	// The last one is done, but is yet to be joined.
+	if(writerStarted)
+	{
+		pthread_join(writer, 0);
+		writerStarted = false;
+	}
+
+	Job *job = prepare(conf, drumkit);
+	if(job)
+	{
+		writerStarted = writerBusy = pthread_create(&writer, 0, writerMain, job) == 0;
+		if(!writerStarted)
+		{
+			LogPtr log = LogFactory::getLog(__FILE__);
+			LOG_WARN(log, "Unable to start writing compiled kit " << cacheFile);
+			finish(job);
+		}
+	}
+
+	bool started = writerStarted;
+	pthread_mutex_unlock(&writerLock);
+
+	return started;
+}
+
+void KitCache::waitForWrites()
+{
+	// Join it without the lock; the writer takes it on its way out.
+	pthread_mutex_lock(&writerLock);
+
+	bool started = writerStarted;
+	pthread_t thread = writer;
+	writerStarted = false;
+
+	pthread_mutex_unlock(&writerLock);
+
+	if(started)
+		pthread_join(thread, 0);
+}
+
+void* KitCache::writerMain(void *arg)
+{
+	Job *job = (Job*)arg;
+	run(*job);
+	finish(job);
+
+	pthread_mutex_lock(&writerLock);
+	writerBusy = false;
+	pthread_mutex_unlock(&writerLock);
+
+	return 0;
+}
+
+KitCache::Job* KitCache::prepare(Configuration &conf, Drumkit &drumkit)
+{
+	if(cacheFile.empty())
+		return 0;
+
+	// Tie it to the kit file as it was loaded, not as it may be by the time
+	// it's written.
+	struct stat kitStat;
+	string contents;
+	if(stat(kitFile.c_str(), &kitStat) != 0 || !readFile(kitFile, contents))
+		return 0;
+
+	Job *job = new Job();
+	job->kitFile = kitFile;
+	job->cacheFile = cacheFile;
+	job->maxSamples = maxSamples;
+	job->kitSize = (uint64_t)kitStat.st_size;
+	job->kitModified = (int64_t)kitStat.st_mtim.tv_sec;
+	job->kitModifiedNanos = (int64_t)kitStat.st_mtim.tv_nsec;
+	job->kitHash = hashBytes(contents.data(), contents.length());
+	job->config = serialize(conf);
+
+	// Each wave once, in the order the kit uses them. Each is held, so it
+	// outlasts the kit if the kit is replaced before it's written.
+	map<string, const Sample*> seen;
+
+	InstrumentList instruments = drumkit.allInstruments();
+	for(InstrumentList::iterator e = instruments.begin(); e != instruments.end(); ++e)
+	{
+		InstrumentLayerList &layers = (*e)->getLayers();
+		for(InstrumentLayerList::iterator f = layers.begin(); f != layers.end(); ++f)
+		{
+			const SampleList &takes = (*f)->getSamples();
+			for(SampleList::const_iterator g = takes.begin(); g != takes.end(); ++g)
+			{
+				string path = SampleRegistry::canonicalPath((*g)->getFilename());
+				if(seen.insert(make_pair(path, *g)).second && SampleRegistry::retain(*g))
+				{
+					job->samples.push_back(*g);
+					job->paths.push_back(path);
+				}
+			}
+		}
+	}
+
+	return job;
+}
+
+void KitCache::finish(Job *job)
+{
+	for(unsigned i = 0; i < job->samples.size(); ++i)
+		SampleRegistry::release(job->samples[i]);
+
+	delete job;
+}
+
+bool KitCache::run(Job &job)
+{
+	LogPtr log = LogFactory::getLog(__FILE__);
+
+	const string &cacheFile = job.cacheFile;
+	string meta = job.config;
+	uint64_t configLength = meta.length();
+
+	// Lay the table out first, to find where the data starts.
+	vector<KitCacheWave> waves;
+	vector<const Sample*> stored;
+	vector<string> storedPaths;
+	uint64_t tableLength = 0;
+
+	for(unsigned i = 0; i < job.samples.size(); ++i)
+	{
+		struct stat waveStat;
+		if(stat(job.paths[i].c_str(), &waveStat) != 0)
+			continue;
+
+		KitCacheWave wave;
+		memset(&wave, 0, sizeof(wave));
+		wave.sourceSize = (uint64_t)waveStat.st_size;
+		wave.sourceModified = (int64_t)waveStat.st_mtim.tv_sec;
+		wave.sourceModifiedNanos = (int64_t)waveStat.st_mtim.tv_nsec;
+		wave.frames = job.samples[i]->frames;
+		wave.sampleRate = job.samples[i]->sampleRate;
+		wave.pathLength = job.paths[i].length();
+
+		waves.push_back(wave);
+		stored.push_back(job.samples[i]);
+		storedPaths.push_back(job.paths[i]);
+		tableLength += sizeof(wave) + wave.pathLength;
+	}
+
+	KitCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KIT_CACHE_MAGIC, sizeof(KIT_CACHE_MAGIC));
+	header.version = KIT_CACHE_VERSION;
+	header.maxSamples = job.maxSamples;
+	header.kitSize = job.kitSize;
+	header.kitModified = job.kitModified;
+	header.kitModifiedNanos = job.kitModifiedNanos;
+	header.kitHash = job.kitHash;
+	header.configLength = configLength;
+	header.waveCount = waves.size();
+	header.metaLength = sizeof(header) + configLength + tableLength;
+
+	string dir = cacheFile.substr(0, cacheFile.rfind('/'));
+	if(!dir.empty() && !makeDirectories(dir))
+	{
+		LOG_WARN(log, "Unable to create " << dir << " for compiled kits: " << strerror(errno));
+		return false;
+	}
+
+	// Write under a temporary name and rename it into place, so another SDDM
+	// never opens half a kit.
+	string temp = cacheFile + ".XXXXXX";
+	int out = mkstemp(&temp[0]);
+	if(out < 0)
+	{
+		LOG_WARN(log, "Unable to write compiled kit " << cacheFile);
+		return false;
+	}
+
+	bool ok = true;
+	uint64_t offset = roundUp(header.metaLength, KIT_CACHE_PAGE);
+
+	for(unsigned i = 0; ok && i < waves.size(); ++i)
+	{
+		const Sample *sample = stored[i];
+		KitCacheWave &wave = waves[i];
+
+		uint64_t planeLength = (uint64_t)sample->frames * sizeof(float);
+
+		// A mono wave was split into two identical channels; keep just the one.
+		bool mono = sample->dataL == sample->dataR
+			|| memcmp(sample->dataL, sample->dataR, planeLength) == 0;
+
+		wave.offset = offset;
+		wave.left = 0;
+		wave.right = mono ? 0 : roundUp(planeLength, KIT_CACHE_PLANE_ALIGN);
+		wave.length = roundUp(wave.right + planeLength, KIT_CACHE_PAGE);
+		if(wave.length == 0)
+			wave.length = KIT_CACHE_PAGE;
+
+		wave.hash = hashBytes(sample->dataL, planeLength);
+		ok = writeAt(out, sample->dataL, planeLength, offset);
+
+		if(ok && !mono)
+		{
+			wave.hash = hashBytes(sample->dataR, planeLength, wave.hash);
+			ok = writeAt(out, sample->dataR, planeLength, offset + wave.right);
+		}
+
+		meta.append((const char*)&wave, sizeof(wave));
+		meta.append(storedPaths[i]);
+
+		offset += wave.length;
+	}
+
+	header.metaHash = hashBytes(meta.data(), meta.length());
+	header.length = offset;
+
+	ok = ok
+		&& writeAt(out, &header, sizeof(header), 0)
+		&& writeAt(out, meta.data(), meta.length(), sizeof(header))
+		&& ftruncate(out, offset) == 0;
+
+	fchmod(out, 0644);
+
+	if(close(out) != 0 || !ok || rename(temp.c_str(), cacheFile.c_str()) != 0)
+	{
+		LOG_WARN(log, "Unable to write compiled kit " << cacheFile);
+		unlink(temp.c_str());
+		return false;
+	}
+
+	LOG_TRACE(log, "compiled " << job.kitFile << " to " << cacheFile << " (" << waves.size() << " waves)");
+	return true;
+}
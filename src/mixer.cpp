@@ -0,0 +1,362 @@
+// mixer.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+
+#if defined(__i386__) || defined(__x86_64__)
+	#define MIXER_X86 1
+	#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define MIXER_NEON 1
+	#include <arm_neon.h>
+#endif
+
+#include "mixer.h"
+
+//
+// Scalar
+//
+void Mixer::mixScalar(
+	float *left, float *right
+, const float *sampleL, const float *sampleR
+, unsigned frames
+, float gainL, float gainR
+, float &peakL, float &peakR)
+{
+	float pkL = peakL, pkR = peakR;
+
+	for(unsigned i = 0; i < frames; ++i)
+	{
+		float valueL = sampleL[i] * gainL;
+		float valueR = sampleR[i] * gainR;
+
+		left[i] += valueL;
+		right[i] += valueR;
+
+		valueL = fabsf(valueL);
+		valueR = fabsf(valueR);
+
+		if(valueL > pkL)
+			pkL = valueL;
+
+		if(valueR > pkR)
+			pkR = valueR;
+	}
+
+	peakL = pkL;
+	peakR = pkR;
+}
+
+/*
+	The soft clip curve: linear up to CLIP_KNEE, then
+		knee + range * over / (over + range)
+	where "over" is how far past the knee we are and "range" is what's left
+	between the knee and full scale. It meets the straight line with the same
+	slope, so there's no corner to hear, and it only reaches 1 at infinity.
+*/
+void Mixer::clipScalar(float *buffer, unsigned frames)
+{
+	const float range = 1.0f - CLIP_KNEE;
+
+	for(unsigned i = 0; i < frames; ++i)
+	{
+		float value = buffer[i];
+		float level = fabsf(value);
+
+		if(level > CLIP_KNEE)
+		{
+			float over = level - CLIP_KNEE;
+			level = CLIP_KNEE + range * over / (over + range);
+			buffer[i] = (value < 0.0f) ? -level : level;
+		}
+	}
+}
+
+#ifdef MIXER_X86
+//
+// SSE2: 4 frames at a time.
+//
+__attribute__((target("sse2")))
+static inline float maxOf(__m128 v)
+{
+	v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+	v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+	return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2")))
+static void mixSSE(
+	float *left, float *right
+, const float *sampleL, const float *sampleR
+, unsigned frames
+, float gainL, float gainR
+, float &peakL, float &peakR)
+{
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 gL = _mm_set1_ps(gainL);
+	const __m128 gR = _mm_set1_ps(gainR);
+	__m128 pkL = _mm_setzero_ps();
+	__m128 pkR = _mm_setzero_ps();
+
+	unsigned blocks = frames & ~3u;
+	for(unsigned i = 0; i < blocks; i += 4)
+	{
+		__m128 valueL = _mm_mul_ps(_mm_loadu_ps(sampleL + i), gL);
+		__m128 valueR = _mm_mul_ps(_mm_loadu_ps(sampleR + i), gR);
+		_mm_storeu_ps(left + i, _mm_add_ps(_mm_loadu_ps(left + i), valueL));
+		_mm_storeu_ps(right + i, _mm_add_ps(_mm_loadu_ps(right + i), valueR));
+
+		pkL = _mm_max_ps(pkL, _mm_and_ps(valueL, absMask));
+		pkR = _mm_max_ps(pkR, _mm_and_ps(valueR, absMask));
+	}
+
+	float mL = maxOf(pkL), mR = maxOf(pkR);
+	if(mL > peakL)
+		peakL = mL;
+	if(mR > peakR)
+		peakR = mR;
+
+	// Leftovers
+	Mixer::mixScalar(left + blocks, right + blocks, sampleL + blocks, sampleR + blocks,
+		frames - blocks, gainL, gainR, peakL, peakR);
+}
+
+__attribute__((target("sse2")))
+static void clipSSE(float *buffer, unsigned frames)
+{
+	const __m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+	const __m128 knee = _mm_set1_ps(CLIP_KNEE);
+	const __m128 range = _mm_set1_ps(1.0f - CLIP_KNEE);
+	const __m128 zero = _mm_setzero_ps();
+
+	unsigned blocks = frames & ~3u;
+	for(unsigned i = 0; i < blocks; i += 4)
+	{
+		__m128 value = _mm_loadu_ps(buffer + i);
+		__m128 sign = _mm_and_ps(value, signMask);
+		__m128 level = _mm_andnot_ps(signMask, value);
+
+		// No branches: "over" is zero under the knee, which leaves the level as it was.
+		__m128 over = _mm_max_ps(_mm_sub_ps(level, knee), zero);
+		level = _mm_add_ps(_mm_min_ps(level, knee),
+			_mm_div_ps(_mm_mul_ps(over, range), _mm_add_ps(over, range)));
+
+		_mm_storeu_ps(buffer + i, _mm_or_ps(level, sign));
+	}
+
+	Mixer::clipScalar(buffer + blocks, frames - blocks);
+}
+
+//
+// AVX: 8 frames at a time.
+//
+__attribute__((target("avx")))
+static void mixAVX(
+	float *left, float *right
+, const float *sampleL, const float *sampleR
+, unsigned frames
+, float gainL, float gainR
+, float &peakL, float &peakR)
+{
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	const __m256 gL = _mm256_set1_ps(gainL);
+	const __m256 gR = _mm256_set1_ps(gainR);
+	__m256 pkL = _mm256_setzero_ps();
+	__m256 pkR = _mm256_setzero_ps();
+
+	unsigned blocks = frames & ~7u;
+	for(unsigned i = 0; i < blocks; i += 8)
+	{
+		__m256 valueL = _mm256_mul_ps(_mm256_loadu_ps(sampleL + i), gL);
+		__m256 valueR = _mm256_mul_ps(_mm256_loadu_ps(sampleR + i), gR);
+		_mm256_storeu_ps(left + i, _mm256_add_ps(_mm256_loadu_ps(left + i), valueL));
+		_mm256_storeu_ps(right + i, _mm256_add_ps(_mm256_loadu_ps(right + i), valueR));
+
+		pkL = _mm256_max_ps(pkL, _mm256_and_ps(valueL, absMask));
+		pkR = _mm256_max_ps(pkR, _mm256_and_ps(valueR, absMask));
+	}
+
+	float mL = maxOf(_mm_max_ps(_mm256_castps256_ps128(pkL), _mm256_extractf128_ps(pkL, 1)));
+	float mR = maxOf(_mm_max_ps(_mm256_castps256_ps128(pkR), _mm256_extractf128_ps(pkR, 1)));
+	if(mL > peakL)
+		peakL = mL;
+	if(mR > peakR)
+		peakR = mR;
+
+	// Hand the tail to SSE, which leaves its own tail to the scalar kernel.
+	// Those are built without VEX encoding, so clear the upper halves first
+	// to avoid the AVX/SSE transition penalty.
+	_mm256_zeroupper();
+	mixSSE(left + blocks, right + blocks, sampleL + blocks, sampleR + blocks,
+		frames - blocks, gainL, gainR, peakL, peakR);
+}
+
+__attribute__((target("avx")))
+static void clipAVX(float *buffer, unsigned frames)
+{
+	const __m256 signMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x80000000));
+	const __m256 knee = _mm256_set1_ps(CLIP_KNEE);
+	const __m256 range = _mm256_set1_ps(1.0f - CLIP_KNEE);
+	const __m256 zero = _mm256_setzero_ps();
+
+	unsigned blocks = frames & ~7u;
+	for(unsigned i = 0; i < blocks; i += 8)
+	{
+		__m256 value = _mm256_loadu_ps(buffer + i);
+		__m256 sign = _mm256_and_ps(value, signMask);
+		__m256 level = _mm256_andnot_ps(signMask, value);
+
+		__m256 over = _mm256_max_ps(_mm256_sub_ps(level, knee), zero);
+		level = _mm256_add_ps(_mm256_min_ps(level, knee),
+			_mm256_div_ps(_mm256_mul_ps(over, range), _mm256_add_ps(over, range)));
+
+		_mm256_storeu_ps(buffer + i, _mm256_or_ps(level, sign));
+	}
+
+	_mm256_zeroupper();
+	clipSSE(buffer + blocks, frames - blocks);
+}
+#endif // MIXER_X86
+
+#ifdef MIXER_NEON
+//
+// NEON: 4 frames at a time.
+//
+static inline float maxOf(float32x4_t v)
+{
+	float32x2_t m = vpmax_f32(vget_low_f32(v), vget_high_f32(v));
+	m = vpmax_f32(m, m);
+	return vget_lane_f32(m, 0);
+}
+
+static void mixNEON(
+	float *left, float *right
+, const float *sampleL, const float *sampleR
+, unsigned frames
+, float gainL, float gainR
+, float &peakL, float &peakR)
+{
+	float32x4_t pkL = vdupq_n_f32(0.0f);
+	float32x4_t pkR = vdupq_n_f32(0.0f);
+
+	unsigned blocks = frames & ~3u;
+	for(unsigned i = 0; i < blocks; i += 4)
+	{
+		float32x4_t valueL = vmulq_n_f32(vld1q_f32(sampleL + i), gainL);
+		float32x4_t valueR = vmulq_n_f32(vld1q_f32(sampleR + i), gainR);
+		vst1q_f32(left + i, vaddq_f32(vld1q_f32(left + i), valueL));
+		vst1q_f32(right + i, vaddq_f32(vld1q_f32(right + i), valueR));
+
+		pkL = vmaxq_f32(pkL, vabsq_f32(valueL));
+		pkR = vmaxq_f32(pkR, vabsq_f32(valueR));
+	}
+
+	float mL = maxOf(pkL), mR = maxOf(pkR);
+	if(mL > peakL)
+		peakL = mL;
+	if(mR > peakR)
+		peakR = mR;
+
+	Mixer::mixScalar(left + blocks, right + blocks, sampleL + blocks, sampleR + blocks,
+		frames - blocks, gainL, gainR, peakL, peakR);
+}
+
+static void clipNEON(float *buffer, unsigned frames)
+{
+	const uint32x4_t signMask = vdupq_n_u32(0x80000000);
+	const float32x4_t knee = vdupq_n_f32(CLIP_KNEE);
+	const float32x4_t range = vdupq_n_f32(1.0f - CLIP_KNEE);
+	const float32x4_t zero = vdupq_n_f32(0.0f);
+
+	unsigned blocks = frames & ~3u;
+	for(unsigned i = 0; i < blocks; i += 4)
+	{
+		float32x4_t value = vld1q_f32(buffer + i);
+		float32x4_t level = vabsq_f32(value);
+
+		float32x4_t over = vmaxq_f32(vsubq_f32(level, knee), zero);
+		float32x4_t denominator = vaddq_f32(over, range);
+
+		// ARMv7 NEON has no divide: refine the reciprocal estimate twice instead.
+		float32x4_t reciprocal = vrecpeq_f32(denominator);
+		reciprocal = vmulq_f32(reciprocal, vrecpsq_f32(denominator, reciprocal));
+		reciprocal = vmulq_f32(reciprocal, vrecpsq_f32(denominator, reciprocal));
+
+		level = vaddq_f32(vminq_f32(level, knee), vmulq_f32(vmulq_f32(over, range), reciprocal));
+
+		vst1q_f32(buffer + i, vbslq_f32(signMask, value, level));
+	}
+
+	Mixer::clipScalar(buffer + blocks, frames - blocks);
+}
+#endif // MIXER_NEON
+
+//
+// Runtime dispatch
+//
+static Mixer::MixFunction selectKernel(const char *&name)
+{
+#ifdef MIXER_X86
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx"))
+	{
+		name = "avx";
+		return mixAVX;
+	}
+
+	if(__builtin_cpu_supports("sse2"))
+	{
+		name = "sse2";
+		return mixSSE;
+	}
+#endif
+
+#ifdef MIXER_NEON
+	name = "neon";
+	return mixNEON;
+#endif
+
+	name = "scalar";
+	return Mixer::mixScalar;
+}
+
+static Mixer::ClipFunction selectClipKernel()
+{
+#ifdef MIXER_X86
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx"))
+		return clipAVX;
+
+	if(__builtin_cpu_supports("sse2"))
+		return clipSSE;
+#endif
+
+#ifdef MIXER_NEON
+	return clipNEON;
+#endif
+
+	return Mixer::clipScalar;
+}
+
+const char *Mixer::kernelName = "scalar";
+Mixer::MixFunction Mixer::kernel = selectKernel(Mixer::kernelName);
+Mixer::ClipFunction Mixer::clipKernel = selectClipKernel();
@@ -21,9 +21,11 @@
 
 #include <map>
 #include <vector>
+#include <algorithm>
 #include <stdio.h>
 #include <iostream>
 #include <fstream>
+#include <cmath>
 
 #include <sndfile.h>
 #include <jack/jack.h>
@@ -31,6 +33,7 @@
 using namespace std;
 
 #include "model.h"
+#include "sampleregistry.h"
 
 //
 // Drumkit
@@ -39,9 +42,19 @@ Drumkit& Drumkit::add(unsigned int midiNote, Instrument *inst)
 {
 	inst->setNoteNumber(midiNote);
 	instruments[midiNote] = inst;
+
+	if(midiNote < MIDI_NOTES)
+		noteTable[midiNote] = inst;
+
 	return *this;
 }
 
+void Drumkit::clearNoteTable()
+{
+	for(unsigned note = 0; note < MIDI_NOTES; ++note)
+		noteTable[note] = 0;
+}
+
 Instrument * Drumkit::findInstrumentByName(const char *name)
 {
 	string str(name);
@@ -57,7 +70,9 @@ Instrument * Drumkit::findInstrumentByName(const char *name)
 
 Instrument* Drumkit::findByNoteNumber(unsigned int noteNumber)
 {
-	return instruments[noteNumber];
+	// Don't use operator[] here; it inserts a null entry for every unmapped note.
+	InstrumentMap::iterator e = instruments.find(noteNumber);
+	return (e != instruments.end()) ? e->second : 0;
 }
 
 InstrumentList Drumkit::allInstruments()
@@ -70,6 +85,69 @@ InstrumentList Drumkit::allInstruments()
 	return list;
 }
 
+bool Drumkit::buildChokeGroups()
+{
+	typedef std::vector<Instrument*> Chokers;
+
+	std::map<Instrument*, Chokers> chokersOf;
+	InstrumentList victims;
+
+	for(InstrumentMap::iterator e = instruments.begin(); e != instruments.end(); ++e)
+	{
+		if(e->second)
+			e->second->setChokeGroup(0).setChokes(0);
+	}
+
+	// Who chokes each victim, in note order.
+	for(InstrumentMap::iterator e = instruments.begin(); e != instruments.end(); ++e)
+	{
+		Instrument *inst = e->second;
+		if(!inst)
+			continue;
+
+		for(InstrumentList::iterator f = inst->getVictims().begin(); f != inst->getVictims().end(); ++f)
+		{
+			Chokers &chokers = chokersOf[*f];
+			if(chokers.empty())
+				victims.push_back(*f);
+
+			if(std::find(chokers.begin(), chokers.end(), inst) == chokers.end())
+				chokers.push_back(inst);
+		}
+	}
+
+	// Victims choked by exactly the same instruments can share a group; no
+	// others can, or a hit would silence something it was never meant to.
+	// Past MAX_CHOKE_GROUPS, victims are left out rather than doubled up.
+	std::map<Chokers, uint32_t> groups;
+	bool complete = true;
+
+	for(InstrumentList::iterator e = victims.begin(); e != victims.end(); ++e)
+	{
+		Instrument *victim = *e;
+		const Chokers &chokers = chokersOf[victim];
+
+		std::map<Chokers, uint32_t>::iterator g = groups.find(chokers);
+		if(g == groups.end())
+		{
+			if(groups.size() == MAX_CHOKE_GROUPS)
+			{
+				complete = false;
+				continue;
+			}
+
+			g = groups.insert(std::make_pair(chokers, (uint32_t)1 << groups.size())).first;
+		}
+
+		victim->setChokeGroup(g->second);
+
+		for(Chokers::const_iterator f = chokers.begin(); f != chokers.end(); ++f)
+			(*f)->setChokes((*f)->getChokes() | g->second);
+	}
+
+	return complete;
+}
+
 Drumkit::~Drumkit()
 {
 	// instruments and submixes cleaned up elsewhere when free
@@ -126,7 +204,38 @@ Drumkit::SubmixList Drumkit::getSubmixes()
 //
 InstrumentLayer::~InstrumentLayer()
 {
-	delete sample;
+	// Other layers (and kits) may be sharing them.
+	for(SampleList::iterator e = samples.begin(); e < samples.end(); ++e)
+		SampleRegistry::release(*e);
+}
+
+const Sample* InstrumentLayer::selectSample()
+{
+	unsigned count = samples.size();
+	if(count < 2)
+		return getSample();
+
+	unsigned i;
+
+	if(selection == RANDOM)
+	{
+		// xorshift32. Skip the sample we played last time, so no take plays twice running.
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+
+		i = state % (count - 1);
+		if(i >= last)
+			++i;
+	}
+	else
+	{
+		i = next;
+		next = (next + 1) % count;
+	}
+
+	last = i;
+	return samples[i];
 }
 
 ostream& operator << (ostream &out, InstrumentLayer &layer)
@@ -141,18 +250,132 @@ ostream& operator << (ostream &out, InstrumentLayer &layer)
 // Instrument
 //
 
-// Find a layer whose range surrounds the specified velocity value
-InstrumentLayer* Instrument::findLayerByVelocity(unsigned int velocity)
+// Add a layer, and point the velocities in its range at it.
+// Where ranges overlap, the layer added first wins.
+Instrument& Instrument::add(InstrumentLayer* layer)
+{
+	layers.push_back(layer);
+
+	unsigned hi = layer->getVelocityHI();
+	if(hi >= MIDI_VELOCITIES)
+		hi = MIDI_VELOCITIES - 1;
+
+	for(unsigned v = layer->getVelocityLO(); v <= hi; ++v)
+	{
+		if(!velocityTable[v])
+			velocityTable[v] = layer;
+	}
+
+	buildCrossfades();
+	return *this;
+}
+
+void Instrument::clearVelocityTable()
+{
+	for(unsigned v = 0; v < MIDI_VELOCITIES; ++v)
+	{
+		velocityTable[v] = 0;
+		layerGain[v] = 1.0f;
+		fadeTable[v] = 0;
+		fadeGain[v] = 0.0f;
+	}
+}
+
+Instrument& Instrument::setCrossfade(unsigned width)
+{
+	crossfade = width;
+	buildCrossfades();
+	return *this;
+}
+
+// Work out the crossfade gains for every velocity, so a hit only has to look them up.
+void Instrument::buildCrossfades()
+{
+	for(unsigned v = 0; v < MIDI_VELOCITIES; ++v)
+	{
+		layerGain[v] = 1.0f;
+		fadeTable[v] = 0;
+		fadeGain[v] = 0.0f;
+	}
+
+	if(crossfade < 2)
+		return;
+
+	// Find each place one layer hands over to the next.
+	for(unsigned edge = 1; edge < MIDI_VELOCITIES; ++edge)
+	{
+		InstrumentLayer *below = velocityTable[edge - 1];
+		InstrumentLayer *above = velocityTable[edge];
+
+		if(!below || !above || below == above)
+			continue;
+
+		int start = (int)edge - (int)(crossfade / 2);
+
+		for(unsigned i = 0; i < crossfade; ++i)
+		{
+			int v = start + (int)i;
+			if(v < 1 || v >= (int)MIDI_VELOCITIES)
+				continue;
+
+			// Don't reach past either layer's own range.
+			if(velocityTable[v] != below && velocityTable[v] != above)
+				continue;
+
+			// Equal power: the two gains' squares always add up to 1.
+			float t = ((float)i + 0.5f) / (float)crossfade;
+			float gainAbove = sinf(t * (float)M_PI_2);
+			float gainBelow = cosf(t * (float)M_PI_2);
+
+			bool isBelow = (velocityTable[v] == below);
+			layerGain[v] = isBelow ? gainBelow : gainAbove;
+			fadeTable[v] = isBelow ? above : below;
+			fadeGain[v] = isBelow ? gainAbove : gainBelow;
+		}
+	}
+}
+
+// Append "lo-hi" (or just "lo") to a list of ranges.
+static void addRange(StringList& list, unsigned lo, unsigned hi)
+{
+	char buf[16];
+	if(lo == hi)
+		sprintf(buf, "%u", lo);
+	else
+		sprintf(buf, "%u-%u", lo, hi);
+
+	list.push_back(buf);
+}
+
+void Instrument::checkVelocityRanges(StringList& gaps, StringList& overlaps)
 {
+	unsigned counts[MIDI_VELOCITIES] = { 0 };
+
 	for(InstrumentLayerList::iterator e = layers.begin(); e < layers.end(); ++e)
 	{
-		InstrumentLayer *layer = *e;
-		if(layer->getVelocityLO() <= velocity && layer->getVelocityHI() >= velocity)
-			return layer;
+		unsigned hi = (*(e))->getVelocityHI();
+		if(hi >= MIDI_VELOCITIES)
+			hi = MIDI_VELOCITIES - 1;
+
+		for(unsigned v = (*(e))->getVelocityLO(); v <= hi; ++v)
+			++counts[v];
 	}
 
-	// Nothing found, return null
-	return 0;
+	// Velocity 0 is a note off, so start at 1.
+	for(unsigned v = 1; v < MIDI_VELOCITIES; )
+	{
+		bool gap = (counts[v] == 0);
+		bool overlap = (counts[v] > 1);
+		unsigned start = v;
+
+		while(v < MIDI_VELOCITIES && (counts[v] == 0) == gap && (counts[v] > 1) == overlap)
+			++v;
+
+		if(gap)
+			addRange(gaps, start, v - 1);
+		else if(overlap)
+			addRange(overlaps, start, v - 1);
+	}
 }
 
 Instrument::~Instrument()
@@ -196,36 +419,3 @@ ostream& operator << (ostream& out, Submix& mix)
 		
 	return out;
 }
-
-//
-// Note
-//
-ostream& operator << (ostream& out, Note& note)
-{
-	out << "Note: number=" << note.getNumber() << " velocity=" << note.getVelocity();
-	return out;
-}
-
-void Note::finish()
-{ 
-	finished = true; 
-	getInstrument()->setVolumes(0,0); 
-}
-
-void Note::cancel()
-{ 
-	finish(); 
-	cancelled = true; 
-}
-
-void Note::set(Instrument * inst, Sample * samp, unsigned int velo, unsigned int num)
-{
-		instrument = inst;
-		sample = samp;
-		velocity = velo;
-		number = num;
-		finished = false;
-		cancelled = false;
-		samplePosition = 0.0f;
-}
-
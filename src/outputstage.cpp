@@ -0,0 +1,155 @@
+// outputstage.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+
+using namespace std;
+
+#include "outputstage.h"
+#include "mixer.h"
+
+// The limiter holds peaks here, under the soft clipper's knee, so anything it
+// catches comes out clean.
+static const float LIMIT_CEILING = CLIP_KNEE;
+
+// How long the limiter takes to let go once a peak has passed.
+static const float RELEASE_SECONDS = 0.08f;
+
+// The gain has to get down to a peak's level within the look-ahead window;
+// this gets it 98% of the way there. The soft clipper catches the rest.
+static const float ATTACK = 1.0f - powf(0.02f, 1.0f / OutputStage::LOOKAHEAD);
+
+OutputStage::OutputStage()
+: limiting(false)
+, sampleRate(0)
+, release(0.0f)
+{
+	reset();
+	lastPeriod = 0;
+}
+
+void OutputStage::reset()
+{
+	gain = 1.0f;
+	floor = 1.0f;
+	head = 0;
+	quiet = LOOKAHEAD;
+
+	for(unsigned i = 0; i < LOOKAHEAD; ++i)
+	{
+		delayL[i] = 0.0f;
+		delayR[i] = 0.0f;
+		needed[i] = 1.0f;
+	}
+}
+
+void OutputStage::setLimiter(bool on, unsigned rate)
+{
+	// Don't play out whatever was in the delay line the last time it was on.
+	if(on && !limiting)
+		reset();
+
+	limiting = on;
+
+	if(rate != sampleRate && rate > 0)
+	{
+		sampleRate = rate;
+		release = 1.0f - expf(-1.0f / (RELEASE_SECONDS * rate));
+	}
+}
+
+void OutputStage::process(float *left, float *right, unsigned frames, unsigned period)
+{
+	// Nobody played into this bus last period. A bus is only let go once its
+	// delay line has played out, so there's nothing left in it worth keeping.
+	if(period != lastPeriod + 1)
+		reset();
+
+	lastPeriod = period;
+
+	if(limiting)
+		limit(left, right, frames);
+
+	Mixer::clip(left, frames);
+	Mixer::clip(right, frames);
+}
+
+void OutputStage::limit(float *left, float *right, unsigned frames)
+{
+	float g = gain;
+	float low = floor;
+	unsigned h = head;
+	unsigned q = quiet;
+
+	for(unsigned i = 0; i < frames; ++i)
+	{
+		float inL = left[i];
+		float inR = right[i];
+
+		float peak = fabsf(inL);
+		if(fabsf(inR) > peak)
+			peak = fabsf(inR);
+
+		float need = (peak > LIMIT_CEILING) ? LIMIT_CEILING / peak : 1.0f;
+
+		if(peak > 0.0f)
+			q = 0;
+		else if(q < LOOKAHEAD)
+			++q;
+
+		// The frame coming in takes the place of the one going out.
+		float leaving = needed[h];
+		needed[h] = need;
+
+		float outL = delayL[h];
+		float outR = delayR[h];
+		delayL[h] = inL;
+		delayR[h] = inR;
+
+		if(++h == LOOKAHEAD)
+			h = 0;
+
+		// Keep track of the lowest gain in the window. Only look through the
+		// whole window when the frame that set it has just left.
+		if(need <= low)
+		{
+			low = need;
+		}
+		else if(leaving <= low && low < 1.0f)
+		{
+			low = 1.0f;
+			for(unsigned k = 0; k < LOOKAHEAD; ++k)
+			{
+				if(needed[k] < low)
+					low = needed[k];
+			}
+		}
+
+		g += (low - g) * ((low < g) ? ATTACK : release);
+
+		left[i] = outL * g;
+		right[i] = outR * g;
+	}
+
+	gain = g;
+	floor = low;
+	head = h;
+	quiet = q;
+}
@@ -0,0 +1,67 @@
+// resampler.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+
+using namespace std;
+
+#include "resampler.h"
+
+float SincInterpolator::table[SincInterpolator::BANDS][SincInterpolator::PHASES + 1][SincInterpolator::TAPS];
+
+/** Fill in the windowed-sinc tables. Each phase's taps are normalized to add up
+	to 1, so a constant signal comes out at the same level. */
+bool SincInterpolator::buildTables()
+{
+	// Cutoff (relative to Nyquist) for each band. Band 0 is for unpitched-down voices.
+	static const double cutoffs[BANDS] = { 0.95, 0.78, 0.58, 0.45 };
+
+	for(unsigned b = 0; b < BANDS; ++b)
+	{
+		for(unsigned ph = 0; ph <= PHASES; ++ph)
+		{
+			double frac = (double)ph / PHASES;
+			double total = 0.0;
+
+			for(unsigned k = 0; k < TAPS; ++k)
+			{
+				// Distance from the position to this tap, in frames.
+				double x = (double)k - BEFORE - frac;
+				double arg = M_PI * cutoffs[b] * x;
+				double sinc = (fabs(arg) < 1e-9) ? 1.0 : sin(arg) / arg;
+
+				// Blackman window, centred on the position, spanning all the taps.
+				double w = (x + TAPS / 2.0) / TAPS;
+				double window = (w <= 0.0 || w >= 1.0) ? 0.0
+					: 0.42 - 0.5 * cos(2.0 * M_PI * w) + 0.08 * cos(4.0 * M_PI * w);
+
+				table[b][ph][k] = (float)(sinc * window);
+				total += sinc * window;
+			}
+
+			for(unsigned k = 0; k < TAPS; ++k)
+				table[b][ph][k] = (float)(table[b][ph][k] / total);
+		}
+	}
+
+	return true;
+}
+
+static bool sincTablesBuilt = SincInterpolator::buildTables();
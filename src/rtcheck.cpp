@@ -0,0 +1,96 @@
+// rtcheck.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rtcheck.h"
+
+#ifdef SDDM_RT_ALLOC_CHECK
+
+static __thread bool inProcessThread = false;
+static unsigned long allocCount = 0;
+static int abortOnAlloc = -1;
+
+// Don't use anything that allocates in here: that includes iostreams.
+static void rtAllocated()
+{
+	if(!inProcessThread)
+		return;
+
+	__sync_fetch_and_add(&allocCount, 1);
+
+	if(abortOnAlloc == -1)
+		abortOnAlloc = (getenv("SDDM_RT_ALLOC_ABORT") != 0)? 1: 0;
+
+	if(abortOnAlloc)
+	{
+		static const char msg[] = "RTAllocCheck: heap allocation on the process thread\n";
+		ssize_t rc = write(2, msg, sizeof(msg) - 1);
+		(void)rc;
+		abort();
+	}
+}
+
+// glibc lets an application interpose its own malloc family, provided all of
+// malloc, calloc, realloc and free are replaced together. new/delete come through here too.
+extern "C" {
+	void *__libc_malloc(size_t);
+	void *__libc_calloc(size_t, size_t);
+	void *__libc_realloc(void *, size_t);
+	void __libc_free(void *);
+
+	void *malloc(size_t size)
+	{
+		rtAllocated();
+		return __libc_malloc(size);
+	}
+
+	void *calloc(size_t n, size_t size)
+	{
+		rtAllocated();
+		return __libc_calloc(n, size);
+	}
+
+	void *realloc(void *ptr, size_t size)
+	{
+		rtAllocated();
+		return __libc_realloc(ptr, size);
+	}
+
+	void free(void *ptr)
+	{
+		if(ptr)
+			rtAllocated();
+		__libc_free(ptr);
+	}
+}
+
+void RTAllocCheck::enter() { inProcessThread = true; }
+void RTAllocCheck::leave() { inProcessThread = false; }
+unsigned long RTAllocCheck::getCount() { return allocCount; }
+
+#else // !SDDM_RT_ALLOC_CHECK
+
+void RTAllocCheck::enter() {}
+void RTAllocCheck::leave() {}
+unsigned long RTAllocCheck::getCount() { return 0; }
+
+#endif // SDDM_RT_ALLOC_CHECK
@@ -0,0 +1,172 @@
+// sampleloader.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+
+using namespace std;
+
+#include "sampleloader.h"
+#include "model.h"
+#include "sampleregistry.h"
+
+SampleLoader::SampleLoader(int maxSamples)
+: maxSamples(maxSamples)
+, nextJob(0)
+, nextTaken(0)
+, cancelled(false)
+{
+	pthread_mutex_init(&mutex, 0);
+	pthread_cond_init(&loaded, 0);
+}
+
+SampleLoader::~SampleLoader()
+{
+	cancel();
+	join();
+
+	for(unsigned i = nextTaken; i < jobs.size(); ++i)
+		SampleRegistry::release(jobs[i].sample);
+
+	pthread_cond_destroy(&loaded);
+	pthread_mutex_destroy(&mutex);
+}
+
+void SampleLoader::add(const string &filename)
+{
+	Job job;
+	job.filename = filename;
+	job.sample = 0;
+	job.done = false;
+
+	jobs.push_back(job);
+}
+
+void SampleLoader::add(const string &filename, Sample *sample)
+{
+	Job job;
+	job.filename = filename;
+	job.sample = sample;
+	job.done = true;
+
+	jobs.push_back(job);
+}
+
+void SampleLoader::start(unsigned count)
+{
+	if(count == 0)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		count = (cpus > 0) ? (unsigned)cpus : 1;
+	}
+
+	// No more threads than files still to load.
+	unsigned waiting = 0;
+	for(vector<Job>::iterator e = jobs.begin(); e != jobs.end(); ++e)
+	{
+		if(!(*e).done)
+			++waiting;
+	}
+
+	if(count > waiting)
+		count = waiting;
+
+	for(unsigned i = 0; i < count; ++i)
+	{
+		pthread_t thread;
+		if(pthread_create(&thread, 0, threadMain, this) == 0)
+			threads.push_back(thread);
+	}
+
+	// Couldn't start any? Then take() loads them itself.
+}
+
+Sample* SampleLoader::take(const string &filename)
+{
+	if(nextTaken >= jobs.size() || jobs[nextTaken].filename != filename)
+		return SampleRegistry::acquire(filename, maxSamples);
+
+	Job &job = jobs[nextTaken];
+
+	pthread_mutex_lock(&mutex);
+
+	// With no threads (or if they've been cancelled), load it here.
+	if(!job.done && (threads.empty() || cancelled) && nextJob <= nextTaken)
+	{
+		nextJob = nextTaken + 1;
+		pthread_mutex_unlock(&mutex);
+
+		job.sample = SampleRegistry::acquire(job.filename, maxSamples);
+
+		pthread_mutex_lock(&mutex);
+		job.done = true;
+	}
+
+	while(!job.done)
+		pthread_cond_wait(&loaded, &mutex);
+
+	pthread_mutex_unlock(&mutex);
+
+	++nextTaken;
+	return job.sample;
+}
+
+void SampleLoader::cancel()
+{
+	pthread_mutex_lock(&mutex);
+	cancelled = true;
+	pthread_mutex_unlock(&mutex);
+}
+
+void SampleLoader::join()
+{
+	for(vector<pthread_t>::iterator e = threads.begin(); e != threads.end(); ++e)
+		pthread_join(*e, 0);
+
+	threads.clear();
+}
+
+void SampleLoader::work()
+{
+	pthread_mutex_lock(&mutex);
+
+	while(!cancelled && nextJob < jobs.size())
+	{
+		Job &job = jobs[nextJob++];
+		if(job.done)
+			continue;
+
+		pthread_mutex_unlock(&mutex);
+
+		Sample *sample = SampleRegistry::acquire(job.filename, maxSamples);
+
+		pthread_mutex_lock(&mutex);
+		job.sample = sample;
+		job.done = true;
+		pthread_cond_broadcast(&loaded);
+	}
+
+	pthread_mutex_unlock(&mutex);
+}
+
+void* SampleLoader::threadMain(void *arg)
+{
+	((SampleLoader*)arg)->work();
+	return 0;
+}
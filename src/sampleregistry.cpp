@@ -0,0 +1,275 @@
+// sampleregistry.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#include "sampleregistry.h"
+#include "model.h"
+
+SampleRegistry::KeyMap SampleRegistry::byKey;
+SampleRegistry::SampleMap SampleRegistry::bySample;
+pthread_mutex_t SampleRegistry::mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t SampleRegistry::loaded = PTHREAD_COND_INITIALIZER;
+
+string SampleRegistry::canonicalPath(const string &filename)
+{
+	char path[PATH_MAX];
+	if(realpath(filename.c_str(), path))
+		return path;
+
+	return filename;
+}
+
+string SampleRegistry::keyFor(const string &path, int maxSamples)
+{
+	char limit[16];
+	snprintf(limit, sizeof(limit), "%d", maxSamples);
+
+	return path + "\n" + limit;
+}
+
+// With the mutex held: the entry "key" finds, as long as its file hasn't changed
+// since it was loaded. One that has is dropped from the key map, though it stays
+// alive for the layers still using it.
+SampleRegistry::Entry* SampleRegistry::findCurrent(const string &key, const string &filename)
+{
+	KeyMap::iterator e = byKey.find(key);
+	if(e == byKey.end())
+		return 0;
+
+	Entry *entry = e->second;
+	if(entry->loading)
+		return entry;
+
+	struct stat source;
+	if(stat(filename.c_str(), &source) == 0
+		&& source.st_size == entry->size
+		&& source.st_mtim.tv_sec == entry->modified
+		&& source.st_mtim.tv_nsec == entry->modifiedNanos)
+		return entry;
+
+	entry->current = false;
+	byKey.erase(e);
+	return 0;
+}
+
+// With the mutex held: a new entry for "key", with one reference.
+SampleRegistry::Entry* SampleRegistry::insert(const string &key, const string &filename, Sample *sample)
+{
+	Entry *entry = new Entry();
+	entry->key = key;
+	entry->sample = sample;
+	entry->refs = 1;
+	entry->loading = (sample == 0);
+	entry->current = true;
+	entry->size = 0;
+	entry->modified = 0;
+	entry->modifiedNanos = 0;
+
+	struct stat source;
+	if(stat(filename.c_str(), &source) == 0)
+	{
+		entry->size = source.st_size;
+		entry->modified = source.st_mtim.tv_sec;
+		entry->modifiedNanos = source.st_mtim.tv_nsec;
+	}
+
+	byKey[key] = entry;
+	if(sample)
+		bySample[sample] = entry;
+
+	return entry;
+}
+
+// With the mutex held: drop a reference to an entry whose load failed.
+void SampleRegistry::forget(Entry *entry)
+{
+	if(--entry->refs == 0)
+		delete entry;
+}
+
+Sample* SampleRegistry::acquire(const string &filename, int maxSamples)
+{
+	string path = canonicalPath(filename);
+	string key = keyFor(path, maxSamples);
+
+	pthread_mutex_lock(&mutex);
+
+	Entry *entry = findCurrent(key, path);
+	if(entry)
+	{
+		++entry->refs;
+		while(entry->loading)
+			pthread_cond_wait(&loaded, &mutex);
+
+		Sample *sample = entry->sample;
+		if(!sample)
+			forget(entry);
+
+		pthread_mutex_unlock(&mutex);
+		return sample;
+	}
+
+	// Nobody has it; load it here, without holding everyone else up.
+	entry = insert(key, path, 0);
+	pthread_mutex_unlock(&mutex);
+
+	Sample *sample = Sample::load(filename, maxSamples);
+
+	pthread_mutex_lock(&mutex);
+
+	entry->loading = false;
+	entry->sample = sample;
+
+	if(sample)
+		bySample[sample] = entry;
+	else
+	{
+		if(entry->current)
+			byKey.erase(key);
+
+		entry->current = false;
+		forget(entry);
+	}
+
+	pthread_cond_broadcast(&loaded);
+	pthread_mutex_unlock(&mutex);
+
+	return sample;
+}
+
+Sample* SampleRegistry::acquireResident(const string &filename, int maxSamples)
+{
+	string path = canonicalPath(filename);
+
+	pthread_mutex_lock(&mutex);
+
+	Sample *sample = 0;
+	Entry *entry = findCurrent(keyFor(path, maxSamples), path);
+	if(entry)
+	{
+		++entry->refs;
+		while(entry->loading)
+			pthread_cond_wait(&loaded, &mutex);
+
+		sample = entry->sample;
+		if(!sample)
+			forget(entry);
+	}
+
+	pthread_mutex_unlock(&mutex);
+	return sample;
+}
+
+Sample* SampleRegistry::adopt(Sample *sample, int maxSamples)
+{
+	if(!sample)
+		return 0;
+
+	string path = canonicalPath(sample->getFilename());
+	string key = keyFor(path, maxSamples);
+	Sample *shared = 0;
+
+	pthread_mutex_lock(&mutex);
+
+	while(!shared)
+	{
+		Entry *entry = findCurrent(key, path);
+		if(!entry)
+		{
+			insert(key, path, sample);
+			break;
+		}
+
+		++entry->refs;
+		while(entry->loading)
+			pthread_cond_wait(&loaded, &mutex);
+
+		shared = entry->sample;
+		if(!shared)
+			forget(entry);		// That load failed; go round and take its place.
+	}
+
+	pthread_mutex_unlock(&mutex);
+
+	if(shared)
+	{
+		delete sample;
+		return shared;
+	}
+
+	return sample;
+}
+
+bool SampleRegistry::retain(const Sample *sample)
+{
+	pthread_mutex_lock(&mutex);
+
+	SampleMap::iterator e = bySample.find(sample);
+	bool found = e != bySample.end();
+	if(found)
+		++e->second->refs;
+
+	pthread_mutex_unlock(&mutex);
+	return found;
+}
+
+void SampleRegistry::release(const Sample *sample)
+{
+	if(!sample)
+		return;
+
+	pthread_mutex_lock(&mutex);
+
+	SampleMap::iterator e = bySample.find(sample);
+	if(e != bySample.end())
+	{
+		Entry *entry = e->second;
+		if(--entry->refs > 0)
+		{
+			pthread_mutex_unlock(&mutex);
+			return;
+		}
+
+		bySample.erase(e);
+		if(entry->current)
+			byKey.erase(entry->key);
+
+		delete entry;
+	}
+
+	pthread_mutex_unlock(&mutex);
+
+	delete sample;
+}
+
+unsigned SampleRegistry::size()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned count = bySample.size();
+	pthread_mutex_unlock(&mutex);
+
+	return count;
+}
@@ -0,0 +1,299 @@
+// samplestore.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+using namespace std;
+
+#include "samplestore.h"
+#include "model.h"
+#include "log.h"
+
+string SampleStore::directory;
+
+static const char STORE_MAGIC[8] = { 'S', 'D', 'D', 'M', 'F', '3', '2', 0 };
+static const uint32_t STORE_VERSION = 1;
+
+/// Where the sample data starts. A whole page in, so it maps on a page boundary.
+static const uint64_t STORE_DATA_ALIGN = 4096;
+
+/// The right channel starts on a cache line, same as a new[]ed buffer would.
+static const uint64_t STORE_PLANE_ALIGN = 64;
+
+/** The start of every file in the store. The wave's full path follows it, then
+	the left channel at "left" and the right at "right" (the same place, for a
+	mono sample). */
+struct StoreHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t frames;
+	uint32_t sampleRate;
+	int32_t maxSamples;
+	uint64_t sourceSize;
+	int64_t sourceModified;
+	int64_t sourceModifiedNanos;
+	uint32_t pathLength;
+	uint32_t reserved;
+	uint64_t left;
+	uint64_t right;
+	uint64_t length;		///< Of the whole file.
+};
+
+static uint64_t roundUp(uint64_t n, uint64_t to)
+{
+	return (n + to - 1) / to * to;
+}
+
+static string canonical(const string &filename)
+{
+	char path[PATH_MAX];
+	if(realpath(filename.c_str(), path))
+		return path;
+
+	return filename;
+}
+
+static void describeSource(StoreHeader &header, const struct stat &source)
+{
+	header.sourceSize = (uint64_t)source.st_size;
+	header.sourceModified = (int64_t)source.st_mtim.tv_sec;
+	header.sourceModifiedNanos = (int64_t)source.st_mtim.tv_nsec;
+}
+
+static bool writeAll(int fd, const void *data, size_t length)
+{
+	const char *p = (const char*)data;
+
+	while(length > 0)
+	{
+		ssize_t written = write(fd, p, length);
+		if(written <= 0)
+			return false;
+
+		p += written;
+		length -= written;
+	}
+
+	return true;
+}
+
+// Make "path" and any directories above it that aren't there yet.
+static bool makeDirectories(const string &path)
+{
+	for(string::size_type slash = path.find('/', 1); ; slash = path.find('/', slash + 1))
+	{
+		string dir = path.substr(0, slash);
+		if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+			return false;
+
+		if(slash == string::npos)
+			return true;
+	}
+}
+
+void SampleStore::setDirectory(const string &dir)
+{
+	directory = dir;
+
+	// Drop any trailing slash so entry names come out tidy.
+	while(directory.length() > 1 && directory[directory.length() - 1] == '/')
+		directory.erase(directory.length() - 1);
+}
+
+// Entries are named after a hash (64-bit FNV-1a) of the wave's full path and the
+// sample limit it was loaded with. The path itself is kept in the entry too, so a
+// collision is spotted rather than played.
+string SampleStore::entryFor(const string &path, int maxSamples)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for(string::const_iterator e = path.begin(); e != path.end(); ++e)
+	{
+		hash ^= (unsigned char)(*(e));
+		hash *= 1099511628211ULL;
+	}
+
+	for(unsigned i = 0; i < sizeof(maxSamples); ++i)
+	{
+		hash ^= (unsigned char)(maxSamples >> (i * 8));
+		hash *= 1099511628211ULL;
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.f32", (unsigned long long)hash);
+
+	return directory + "/" + name;
+}
+
+Sample* SampleStore::map(const string &filename, int maxSamples)
+{
+	if(!isEnabled())
+		return 0;
+
+	struct stat source;
+	if(stat(filename.c_str(), &source) != 0)
+		return 0;
+
+	string path = canonical(filename);
+
+	int fd = open(entryFor(path, maxSamples).c_str(), O_RDONLY);
+	if(fd < 0)
+		return 0;
+
+	StoreHeader header;
+	StoreHeader expected;
+	describeSource(expected, source);
+
+	struct stat entry;
+	bool valid = fstat(fd, &entry) == 0
+		&& pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+		&& memcmp(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC)) == 0
+		&& header.version == STORE_VERSION
+		&& header.maxSamples == maxSamples
+		&& header.sourceSize == expected.sourceSize
+		&& header.sourceModified == expected.sourceModified
+		&& header.sourceModifiedNanos == expected.sourceModifiedNanos
+		&& header.pathLength == path.length()
+		&& header.length == (uint64_t)entry.st_size
+		&& header.right + (uint64_t)header.frames * sizeof(float) <= header.length
+		&& header.left + (uint64_t)header.frames * sizeof(float) <= header.length;
+
+	if(valid)
+	{
+		string stored(header.pathLength, '\0');
+		valid = pread(fd, &stored[0], header.pathLength, sizeof(header)) == (ssize_t)header.pathLength
+			&& stored == path;
+	}
+
+	if(!valid)
+	{
+		close(fd);
+		return 0;
+	}
+
+	// Fault the whole thing in now, rather than on the process thread the first
+	// time each note plays.
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+
+	void *mapping = mmap(0, header.length, PROT_READ, flags, fd, 0);
+	close(fd);
+
+	if(mapping == MAP_FAILED)
+		return 0;
+
+	Sample *sample = new Sample(header.frames, filename);
+	sample->sampleRate = header.sampleRate;
+	sample->dataL = (float*)((char*)mapping + header.left);
+	sample->dataR = (float*)((char*)mapping + header.right);
+	sample->mapping = mapping;
+	sample->mappingLength = header.length;
+
+	return sample;
+}
+
+bool SampleStore::store(const Sample &sample, int maxSamples)
+{
+	if(!isEnabled())
+		return false;
+
+	struct stat source;
+	if(stat(sample.getFilename().c_str(), &source) != 0)
+		return false;
+
+	string path = canonical(sample.getFilename());
+	uint64_t planeLength = (uint64_t)sample.frames * sizeof(float);
+
+	// A mono wave was split into two identical channels; keep just the one.
+	bool mono = sample.dataL == sample.dataR
+		|| memcmp(sample.dataL, sample.dataR, planeLength) == 0;
+
+	StoreHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+	header.version = STORE_VERSION;
+	header.frames = sample.frames;
+	header.sampleRate = sample.sampleRate;
+	header.maxSamples = maxSamples;
+	describeSource(header, source);
+	header.pathLength = path.length();
+	header.left = roundUp(sizeof(header) + path.length(), STORE_DATA_ALIGN);
+	header.right = mono ? header.left : roundUp(header.left + planeLength, STORE_PLANE_ALIGN);
+	header.length = header.right + planeLength;
+
+	// Say why nothing's being stored, but just the once, not for every wave.
+	static bool warned = false;
+	if(!makeDirectories(directory))
+	{
+		if(!__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+		{
+			LogPtr log = LogFactory::getLog(__FILE__);
+			LOG_WARN(log, "Unable to create sample cache " << directory << ": " << strerror(errno) << endl);
+		}
+
+		return false;
+	}
+
+	// Write it under a temporary name and rename it into place, so nobody ever
+	// maps half a file (and two loaders storing the same wave don't collide).
+	string entry = entryFor(path, maxSamples);
+	string temp = entry + ".XXXXXX";
+
+	int fd = mkstemp(&temp[0]);
+	if(fd < 0)
+		return false;
+
+	static const char zeros[STORE_DATA_ALIGN] = { 0 };
+	uint64_t written = sizeof(header) + path.length();
+
+	bool ok = writeAll(fd, &header, sizeof(header))
+		&& writeAll(fd, path.data(), path.length())
+		&& writeAll(fd, zeros, header.left - written)
+		&& writeAll(fd, sample.dataL, planeLength);
+
+	if(ok && !mono)
+	{
+		written = header.left + planeLength;
+		ok = writeAll(fd, zeros, header.right - written)
+			&& writeAll(fd, sample.dataR, planeLength);
+	}
+
+	fchmod(fd, 0644);
+
+	if(close(fd) != 0 || !ok || rename(temp.c_str(), entry.c_str()) != 0)
+	{
+		unlink(temp.c_str());
+		return false;
+	}
+
+	return true;
+}
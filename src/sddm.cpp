@@ -20,7 +20,6 @@
 #include <vector>
 #include <map>
 #include <stack>
-#include <deque>
 #include <iostream>
 #include <fstream>
 #include <stdio.h>
@@ -39,46 +38,90 @@ using namespace std;
 #include "midi.h"
 #include "alsamidi.h"
 #include "audio_driver.h"
+#include "mixer.h"
+#include "resampler.h"
 
 #include "config.h"
+#include "kitcache.h"
 
 #include "sddm.h"
 #include "streamer.h"
 
-const int MAX_POLY = 8; // TODO: Change to something higher
+// How many voices can play at once.
+const unsigned MAX_VOICES = 256;
 
-const float LIMIT = 1.0f;
+// How long a stolen voice takes to fade out.
+const float STEAL_FADE_SECONDS = 0.005f;
+
+// The slowest a voice steps through its sample (a pitch of -99). Anything
+// slower would never get to the end, and the voice would never finish.
+const double MIN_PITCH_RATIO = 0.01;
 
 SDDM * SDDM::instance = 0;
 
-pthread_mutex_t SDDM::notemutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t SDDM::orphanmutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 SDDM::SDDM()
-: kit(0)
+: current(0)
+, playing(0)
+, liveGeneration(0)
+, droppedEvents(0)
+, queuedNotes(0)
+, queueDelayTotal(0)
+, queueDelayMax(0)
+, unroutedVoices(0)
+, voices(MAX_VOICES)
+, periods(0)
+, busCount(0)
+, drainCount(0)
+, mainDraining(false)
+, busVoices(new unsigned[MAX_VOICES])
 , sampleEndGap(0)
 , maxPolyphony(-1)
 , verbose(false)
+, cleanupQuit(false)
 {
 	// initialize mutex
 	pthread_mutex_init(&SDDM::orphanmutex, 0);
-	// Fill the "available notes" queue with Notes.
-	for(int i = 0; i < MAX_POLY; ++i)
-	{
-		availableNotes.push_front(new Note());
-	}
+
+	sem_init(&cleanupWakeup, 0, 0);
+	cleanupRunning = (pthread_create(&cleanupThread, 0, cleanupMain, this) == 0);
+
+	for(unsigned i = 0; i < AudioDriver::MAX_PORTS; ++i)
+		busSlot[i] = -1;
+
+	cout << "mixer kernel: " << Mixer::getKernelName() << endl;
 }
 
 SDDM::~SDDM()
 {
 	cout << "SDDM dtor" << endl;
 
-	for(NoteQueue::iterator e = availableNotes.begin(); e != availableNotes.end(); ++e)
+	if(cleanupRunning)
+	{
+		__atomic_store_n(&cleanupQuit, true, __ATOMIC_RELEASE);
+		sem_post(&cleanupWakeup);
+		pthread_join(cleanupThread, 0);
+	}
+	sem_destroy(&cleanupWakeup);
+
+	KitCache::waitForWrites();
+
+	if(queuedNotes > 0)
 	{
-		delete (*(e));
+		cout << "note queue delay: avg " << (double)queueDelayTotal / queuedNotes
+			<< " frames, max " << queueDelayMax << " frames over " << queuedNotes << " notes" << endl;
 	}
 
+	if(streamer.isRunning())
+		cout << "stream underruns: " << streamer.getUnderruns() << endl;
+
+	if(unroutedVoices > 0)
+		cout << "voices with no bus to play on: " << unroutedVoices << endl;
+
+	delete[] busVoices;
+
 	cout << "SDDM dtor end" << endl;
 }
 
@@ -102,25 +145,34 @@ bool SDDM::loadKit(
 
 	Configuration conf(includedSubmixes);
 
-	if (this->kit) {
+	if (current) {
 		// reuse the existing submixes in the new kit if possible
-		SubmixList existingSubmixes = this->kit->getSubmixes();
+		SubmixList existingSubmixes = current->kit->getSubmixes();
 		for (unsigned i = 0; i < existingSubmixes.size(); ++i) {
 			existingSubmixes[i]->setOrphaned(true);
 			newKit->addSubmix(existingSubmixes[i]);
 		}
 		// try to reuse orphaned submixes (so they don't close ports)
 		pthread_mutex_lock(&orphanmutex);
-		for (std::set<Submix*>::iterator e = orphanSubmixes.begin();
+		for (std::map<Submix*, unsigned>::iterator e = orphanSubmixes.begin();
 				e != orphanSubmixes.end(); ++e) {
-			newKit->addSubmix(*e);
+			e->first->setOrphaned(true);
+			newKit->addSubmix(e->first);
 		}
 		orphanSubmixes.clear();
 		pthread_mutex_unlock(&orphanmutex);
 	}
 
 
- 	if(!conf.load(filename, newKit, ignorePorts, maxSamples, listener))
+	// Load from the compiled kit if it's up to date. A compiled kit holds whole
+	// samples, so it's no use when only the start of each one is kept in memory.
+	KitCache cache(kitFile, maxSamples);
+	KitCache *compiled = DiskStreamer::isEnabled() ? 0 : &cache;
+
+	if(DiskStreamer::isEnabled() && !streamer.start())
+		cerr << "Unable to start streaming samples from disk" << endl;
+
+ 	if(!conf.load(filename, newKit, ignorePorts, maxSamples, listener, compiled))
  	{
  		// TODO: reorphan submixes??
  		string msg = "Unable to load ";
@@ -129,6 +181,17 @@ bool SDDM::loadKit(
  		return false;
  	}
 
+	// If it wasn't, compile it so next time is quick, but in the background,
+	// so this load doesn't wait for it. Only the whole kit can be compiled,
+	// though, not a few of its submixes.
+	if(compiled && cache.isStale() && includedSubmixes.empty())
+		cache.writeLater(conf, *newKit);
+
+	// deleteOrphans unregisters ports, and may be doing it on the cleanup
+	// thread, so hold it off while we look ours up. Otherwise we could be
+	// handed a port that's on its way out.
+	pthread_mutex_lock(&orphanmutex);
+
  	SubmixList submixes = newKit->getSubmixes();
  	for(unsigned i = 0; i < submixes.size(); ++i)
  	{
@@ -141,14 +204,19 @@ bool SDDM::loadKit(
  			portL = submixes[i]->getName() + "_L"
  		, portR = submixes[i]->getName() + "_R"
  		;
- 		if(!getAudioDriver()->hasRegisteredPort(portL))
+ 		PortHandle left = getAudioDriver()->findPort(portL);
+ 		PortHandle right = getAudioDriver()->findPort(portR);
+
+ 		if(left == AudioDriver::NO_PORT)
  		{
- 			if(!getAudioDriver()->registerPort(portL))
+ 			left = getAudioDriver()->registerPort(portL);
+ 			if(left == AudioDriver::NO_PORT)
  			{
  				cerr << "Unable to register left port " << portL << endl;
  			}
 
- 			if(!getAudioDriver()->registerPort(portR))
+ 			right = getAudioDriver()->registerPort(portR);
+ 			if(right == AudioDriver::NO_PORT)
  			{
 				cerr << "Unable to register right port " << portR << endl;
 			}
@@ -157,8 +225,13 @@ bool SDDM::loadKit(
 				getAudioDriver()->connectMainStereoOut(portL, portR);
 			}
 		}
+
+		// Cache the handles so the audio thread never looks ports up by name.
+		submixes[i]->setPorts(left, right);
 	}
 
+	pthread_mutex_unlock(&orphanmutex);
+
  	PortNameList ports = newKit->getPortNames();
  	for(unsigned i = 0; i < ports.size(); ++i)
 	{
@@ -166,73 +239,74 @@ bool SDDM::loadKit(
 	}
 
 
- 	if (this->kit) {
-		// block any more notes from the old kit
-		pthread_mutex_lock(&notemutex);
+ 	// switch kits
+	pthread_mutex_lock(&orphanmutex);
 
-		// orphan all old instruments and possibly submixes
-		pthread_mutex_lock(&orphanmutex);
-		std::vector<Instrument*> allInstruments = this->kit->allInstruments();
+	unsigned number = 0;
+
+ 	if (current) {
+		// orphan all old instruments and possibly submixes, tagged with the
+		// generation that still plays them
+		number = current->number;
+
+		std::vector<Instrument*> allInstruments = current->kit->allInstruments();
 		for (unsigned i = 0; i < allInstruments.size(); i++) {
-			orphanInstruments.insert(allInstruments[i]);
+			orphanInstruments[allInstruments[i]] = number;
 		}
 		for (unsigned i = 0; i < submixes.size(); ++i) {
 			if (submixes[i]->isOrphan()) {
-				orphanSubmixes.insert(submixes[i]);
+				orphanSubmixes[submixes[i]] = number;
 				newKit->removeSubmix(submixes[i]);
 			}
 		}
-		pthread_mutex_unlock(&orphanmutex);
+
+		retiredKits.push_back(current);
+		++number;
 	}
 
-	// switch kits
-	Drumkit *oldKit = this->kit;
-	this->kit = newKit;
-	pthread_mutex_unlock(&notemutex);
+	// The audio thread picks the new kit up at the start of its next period.
+	__atomic_store_n(&current, new KitGeneration(newKit, number), __ATOMIC_RELEASE);
 
-	// delete the old kit but orphaned submixes and instruments keep playing
- 	if(oldKit) {
-		delete oldKit;
-	}
+	pthread_mutex_unlock(&orphanmutex);
+
+	// the old kit, orphaned submixes and instruments keep playing until their voices are done
+	deleteOrphans();
 
 	return true;
 }
 
 void SDDM::onMidiMessage(const MidiMessage &msg)
 {
-	if(!kit)
-	{
-		return;
-	}
-
 	switch(msg.type)
 	{
 		case MidiMessage::NOTE_ON:
 		{
-			int noteNumber = msg.data1;
-			int velocity = msg.data2;
-
-			if(velocity > 0)
+			if(msg.data2 > 0)
 			{
-				Instrument *inst = kit->findByNoteNumber(static_cast<unsigned>(noteNumber));
-				if(inst)
+				// Hand the note to the audio thread, which does everything else.
+				NoteEvent event;
+				event.type = (unsigned char)msg.type;
+				event.channel = (msg.channel > 0) ? (unsigned char)msg.channel : 0;
+				event.note = (unsigned char)msg.data1;
+				event.velocity = (unsigned char)msg.data2;
+				event.offset = (msg.frame > 0) ? (unsigned short)msg.frame : 0;
+				event.time = audioDriver ? audioDriver->getFrameTime() : 0;
+				event.timed = 0;
+
+				// If the driver knows how long ago the event came in, go by that instead.
+				if(msg.age >= 0 && audioDriver)
 				{
-					if(inst->hasVictims())
-					{
-						pthread_mutex_lock(&notemutex);
-						cancelNotesFor(inst->getVictims(), playingNotes);
-						cancelNotesFor(inst->getVictims(), pendingNotes);
-						pthread_mutex_unlock(&notemutex);
-					}
-
-					InstrumentLayer* layer = inst->findLayerByVelocity(velocity);
-
-					if(layer && layer->getSample())
-					{
-						Note * n = findLRUNote();
-						n->set(inst, const_cast<Sample*>(layer->getSample()), velocity, noteNumber);
-						pushNote(n);
-					}
+					event.time -= (unsigned)((long long)msg.age * audioDriver->getSampleRate() / 1000000);
+					event.timed = 1;
+				}
+
+				// Drivers that run on the process thread get their own queue,
+				// so each queue still has just the one producer.
+				NoteEventQueue& queue = (audioDriver && audioDriver->isProcessThread()) ? rtEvents : events;
+
+				if(!queue.push(event))
+				{
+					__atomic_fetch_add(&droppedEvents, 1, __ATOMIC_RELAXED);
 				}
 			}
 
@@ -243,371 +317,870 @@ void SDDM::onMidiMessage(const MidiMessage &msg)
 			break;
 	}
 
+	// Never clean up on the process thread: that takes the orphan lock, frees
+	// memory and unregisters ports. Hand it to the cleanup thread instead.
+	if(audioDriver && audioDriver->isProcessThread())
+		sem_post(&cleanupWakeup);
+	else
+		deleteOrphans();
+}
+
+void* SDDM::cleanupMain(void *arg)
+{
+	SDDM *sddm = (SDDM*)arg;
 
-	// TODO: move this to its own low-priority thread
-	std::set<Instrument*> playingInstruments;
-	std::set<Submix*> playingSubmixes;
+	while(true)
+	{
+		sem_wait(&sddm->cleanupWakeup);
+		if(__atomic_load_n(&sddm->cleanupQuit, __ATOMIC_ACQUIRE))
+			break;
 
-	// find currently playing instruments and submixes
-	int rc = pthread_mutex_lock(&notemutex);
-	for (NoteQueue::iterator e = playingNotes.begin(); e != playingNotes.end();
-			++e) {
-		Instrument* instrument = (*e)->getInstrument();
-		playingInstruments.insert(instrument);
-		playingSubmixes.insert(instrument->getSubmix());
+		sddm->deleteOrphans();
 	}
-	rc = pthread_mutex_unlock(&notemutex);
 
-	rc = pthread_mutex_unlock(&orphanmutex);
-	// delete any instrument no longer playing
-	for (std::set<Instrument*>::iterator e = orphanInstruments.begin();
-			e != orphanInstruments.end(); ++e) {
-		Instrument* orphanInstrument = *e;
-		if (playingInstruments.find(orphanInstrument) == playingInstruments.end()) {
-			orphanInstruments.erase(orphanInstrument);
-			delete orphanInstrument;
-			break;
+	return 0;
+}
+
+/** Delete retired kits, and orphaned instruments and submixes, once the audio
+	thread has moved past the generation they belong to.
+	*/
+void SDDM::deleteOrphans()
+{
+	unsigned live = __atomic_load_n(&liveGeneration, __ATOMIC_ACQUIRE);
+
+	pthread_mutex_lock(&orphanmutex);
+
+	// Generations are compared by difference so they can wrap.
+	for (unsigned i = 0; i < retiredKits.size(); ) {
+		if ((int)(retiredKits[i]->number - live) < 0) {
+			delete retiredKits[i]->kit;
+			delete retiredKits[i];
+			retiredKits.erase(retiredKits.begin() + i);
+		} else {
+			++i;
 		}
 	}
-	// delete any submix no longer attached to playing notes
-	for (std::set<Submix*>::iterator e = orphanSubmixes.begin();
-			e != orphanSubmixes.end(); ++e) {
-		Submix* orphanSubmix = *e;
-		if (playingSubmixes.find(orphanSubmix) == playingSubmixes.end()) {
-			orphanSubmixes.erase(orphanSubmix);
-			PortNameList ports = orphanSubmix->getPortNames();
-			for (unsigned j = 0; j < ports.size(); ++j) {
-				audioDriver->unregisterPort(ports[j]);
-			}
+
+	for (std::map<Instrument*, unsigned>::iterator e = orphanInstruments.begin();
+			e != orphanInstruments.end(); ) {
+		if ((int)(e->second - live) < 0) {
+			delete e->first;
+			orphanInstruments.erase(e++);
+		} else {
+			++e;
+		}
+	}
+
+	for (std::map<Submix*, unsigned>::iterator e = orphanSubmixes.begin();
+			e != orphanSubmixes.end(); ) {
+		if ((int)(e->second - live) < 0) {
+			Submix* orphanSubmix = e->first;
+			audioDriver->unregisterPort(orphanSubmix->getLeftPort());
+			audioDriver->unregisterPort(orphanSubmix->getRightPort());
 			delete orphanSubmix;
-			break; // once is enough per pass
+			orphanSubmixes.erase(e++);
+		} else {
+			++e;
 		}
 	}
-	rc = pthread_mutex_unlock(&orphanmutex);
 
+	pthread_mutex_unlock(&orphanmutex);
+}
+
+/** Start voices for all the note events that came in since the last period.
+	Runs on the audio thread, which owns the voice table.
+	*/
+void SDDM::drainEvents()
+{
+	unsigned now = audioDriver->getPeriodStartTime();
 
+	int period = audioDriver->getBufferSize();
+
+	drainEvents(rtEvents, now, period);
+	drainEvents(events, now, period);
 }
 
-void SDDM::pushNote(Note * note)
+void SDDM::drainEvents(NoteEventQueue& queue, unsigned now, int period)
 {
-	int rc = pthread_mutex_lock(&notemutex);
-	pendingNotes.push_front(note);
-	rc = pthread_mutex_unlock(&notemutex);
+	NoteEvent event;
+
+	while(queue.pop(event))
+	{
+		if(event.type != MidiMessage::NOTE_ON)
+		{
+			continue;
+		}
+
+		// Keep track of how long notes sit in the queue.
+		int delay = (int)(now - event.time);
+		if(delay < 0)
+		{
+			delay = 0;
+		}
+
+		// Timestamped notes play one period after they came in, at the same
+		// frame they came in at, so they all land the same distance behind their
+		// MIDI instead of wherever the period boundary happened to fall.
+		if(event.timed)
+		{
+			int offset = (int)(event.time + period - now);
+			if(offset < 0)
+				offset = 0;
+			else if(offset >= 2 * period)
+				offset = 2 * period - 1;
+
+			event.offset = (unsigned short)offset;
+		}
+
+		__atomic_store_n(&queuedNotes, queuedNotes + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&queueDelayTotal, queueDelayTotal + delay, __ATOMIC_RELAXED);
+		if((unsigned)delay > queueDelayMax)
+		{
+			__atomic_store_n(&queueDelayMax, (unsigned)delay, __ATOMIC_RELAXED);
+		}
+
+		Instrument *inst = playing->kit->findByNote(event.note);
+		if(inst)
+		{
+			if(inst->getChokes())
+			{
+				chokeVoices(inst->getChokes());
+			}
+
+			InstrumentLayer* layer = inst->findLayerByVelocity(event.velocity);
+			float gain = inst->getLayerGain(event.velocity);
+			bool primary = layer && layer->getSample() && gain > 0.0f;
+
+			// In a crossfade zone, the neighbouring layer plays too, at the complementary gain.
+			InstrumentLayer* fade = inst->findFadeLayerByVelocity(event.velocity);
+			float fadeGain = inst->getFadeGain(event.velocity);
+			bool partner = fade && fade->getSample() && fadeGain > 0.0f;
+
+			// Make room for the whole hit at once, so one of its voices never
+			// steals the other.
+			unsigned count = (primary ? 1 : 0) + (partner ? 1 : 0);
+			if(count > 0)
+			{
+				makeRoomFor(inst, event.note, count);
+			}
+
+			if(primary)
+			{
+				startVoice(inst, layer->selectSample(), event.velocity, event.note, event.offset, gain);
+			}
+
+			if(partner)
+			{
+				startVoice(inst, fade->selectSample(), event.velocity, event.note, event.offset, fadeGain);
+			}
+		}
+	}
 }
 
-/** Find the least-recently-used note in the available-notes queue.
-  If one is available, return it. Otherwise, push a new note onto the
-	front of the queue.
+/** Start a voice for the specified instrument and sample.
+	The voice stays pending until getBufferRequests picks it up.
+	Call makeRoomFor first. If every voice is in use, cut the oldest one off to make room.
 	*/
-Note * SDDM::findLRUNote()
+void SDDM::startVoice(Instrument * inst, const Sample * sample, unsigned velocity, unsigned noteNumber, unsigned offset, float level)
 {
-	int rc = pthread_mutex_lock(&notemutex);
-	Note * n;
-
-	if(availableNotes.size() > 0)
+	// Every slot is taken, even counting voices on their way out, so one has to
+	// go right now. Take whichever fading voice is nearly done, if there is one.
+	if(voices.isFull())
 	{
-		n = availableNotes.back();
-		// Got a note from the queue. Pop it off
-		availableNotes.pop_back();
+		int victim = -1;
+
+		for(unsigned i = 0; i < voices.size(); ++i)
+		{
+			if(voices.isReleasing(i) && (victim == -1 || voices.fade[i] < voices.fade[victim]))
+				victim = (int)i;
+		}
+
+		if(victim == -1)
+			victim = voices.findOldest();
+
+		voices.finish(victim);
+		removeVoice(victim);
 	}
+
+	int v = voices.add(inst, sample, velocity, noteNumber);
+	voices.offset[v] = offset;
+	voices.level[v] = level;
+	voices.loudness[v] = level;
+	voices.interpolation[v] = (unsigned char)inst->getInterpolation();
+	voices.generation[v] = playing->number;
+
+	// Which bus the voice mixes into is settled now, for the life of the voice.
+	Submix* mix = inst->getSubmix();
+	if(inst->isInSubmix())
+		voices.bus[v] = mix ? mix->getLeftPort() : AudioDriver::NO_PORT;
 	else
+		voices.bus[v] = AudioDriver::LEFT_PORT;
+
+	// Only the start of a long sample is in memory; the rest comes off the disk.
+	// With no stream to spare, the voice plays just the part that's there.
+	if(sample->isStreamed())
 	{
-		// Create a new Note. 
-		// The new Note will be pushed onto the front of the 
-		// "available" queue when it's done being used.
-		n = new Note();
+		int stream = streamer.open(sample);
+		if(stream >= 0)
+		{
+			voices.stream[v] = stream;
+			voices.frames[v] = sample->totalFrames;
+		}
 	}
+}
+
+void SDDM::removeVoice(unsigned i)
+{
+	if(voices.stream[i] >= 0)
+		streamer.close(voices.stream[i]);
 
-	rc = pthread_mutex_unlock(&notemutex);
-	return n;
+	voices.remove(i);
 }
 
-bool SDDM::hasSubmix(SubmixList& list, Submix* mix)
+// Voices still playing for real: not finished, and not fading out.
+// Only those of "inst", unless it's null.
+unsigned SDDM::countVoices(Instrument * inst)
 {
-	for(SubmixList::iterator e = list.begin(); e != list.end(); ++e)
+	unsigned count = 0;
+
+	for(unsigned i = 0; i < voices.size(); ++i)
 	{
-		if((*(e)) == mix)
-		{
-			return true;
-		}
+		if(voices.isFinished(i) || voices.isReleasing(i))
+			continue;
+
+		if(!inst || voices.instrument[i] == inst)
+			++count;
 	}
 
-	return false;
+	return count;
 }
 
-// Return a list of unique submixes for the specified notes.
-SubmixList SDDM::getSubMixesFor(NoteQueue& notes)
+// The most voices the kit can have playing at once.
+unsigned SDDM::getVoiceLimit()
 {
-	SubmixList list;
+	unsigned limit = voices.getCapacity();
 
-	for(NoteQueue::iterator e = notes.begin(); e != notes.end(); ++e)
+	unsigned kitLimit = playing->kit->getPolyphony();
+	if(kitLimit > 0 && kitLimit < limit)
+		limit = kitLimit;
+
+	if(maxPolyphony >= 0 && (unsigned)maxPolyphony < limit)
+		limit = (unsigned)maxPolyphony;
+
+	return limit;
+}
+
+// Pick a voice to give way to a new one, from those of "inst" (or from all of
+// them, if it's null). Returns -1 if there's nothing to take.
+int SDDM::findVictim(Instrument * inst, unsigned noteNumber, Instrument::Stealing policy)
+{
+	int oldest = -1, quietest = -1, sameNote = -1;
+
+	for(unsigned i = 0; i < voices.size(); ++i)
 	{
-		Note* note = *e;
+		if(voices.isFinished(i) || voices.isReleasing(i))
+			continue;
 
-		if(!note->isFinished())
-		{
-			Submix* mix = note->getInstrument()->getSubmix();
+		if(inst && voices.instrument[i] != inst)
+			continue;
 
-			if(mix)
-			{
-				if(!hasSubmix(list, mix))
-				{
-					list.push_back(mix);
-				}
-			}
-		}
+		if(oldest == -1 || (int)(voices.serial[i] - voices.serial[oldest]) < 0)
+			oldest = (int)i;
+
+		if(quietest == -1 || voices.loudness[i] < voices.loudness[quietest])
+			quietest = (int)i;
+
+		if(voices.number[i] == noteNumber
+			&& (sameNote == -1 || (int)(voices.serial[i] - voices.serial[sameNote]) < 0))
+			sameNote = (int)i;
 	}
 
-	return list;
+	switch(policy)
+	{
+		case Instrument::QUIETEST:
+			return quietest;
+
+		case Instrument::SAME_NOTE:
+			return (sameNote != -1) ? sameNote : oldest;
+
+		default:
+			return oldest;
+	}
 }
 
-BufferRequestList SDDM::getBufferRequests()
+// If the instrument, or the whole kit, can't play "count" more voices without
+// going over its limit, fade out as many as it takes to make way for them.
+void SDDM::makeRoomFor(Instrument * inst, unsigned noteNumber, unsigned count)
 {
-	BufferRequestList requests;
+	float fadeStep = 1.0f / (STEAL_FADE_SECONDS * audioDriver->getSampleRate());
 
-	// Jack is asking if we want buffers.
-	if(!pendingNotes.empty())
+	unsigned limit = inst->getPolyphony();
+	while(limit > 0 && countVoices(inst) + count > limit)
 	{
-		Note* note = pendingNotes.front();
-		pthread_mutex_lock(&notemutex);
-		playingNotes.push_front(note);
-		pendingNotes.pop_front();
-		pthread_mutex_unlock(&notemutex);
+		int victim = findVictim(inst, noteNumber, inst->getStealing());
+		if(victim == -1)
+			break;
+
+		voices.release(victim, fadeStep);
 	}
 
-	// Trim off notes beyond our max polyphony setting
-	// TODO: This could go away now that polyphony is fixed.
-	if(maxPolyphony != -1 && (playingNotes.size() > static_cast<unsigned>(maxPolyphony)))
+	limit = getVoiceLimit();
+	if(countVoices(0) + count > limit && verbose)
 	{
-		if(verbose)
-		{
-			cout << "max polyphony: " << maxPolyphony << " reached" << endl;
-		}
+		cout << "max polyphony: " << limit << " reached" << endl;
+	}
+
+	while(countVoices(0) + count > limit)
+	{
+		int victim = findVictim(0, noteNumber, playing->kit->getStealing());
+		if(victim == -1)
+			break;
 
-		pthread_mutex_lock(&notemutex);
+		voices.release(victim, fadeStep);
+	}
+}
 
-		for(NoteQueue::iterator e = playingNotes.begin() + maxPolyphony; e != playingNotes.end(); ++e)
-		{
-			(*(e))->finish();
-		}
+void SDDM::getBufferRequests(BufferRequestList& requests, unsigned)
+{
+	// Forget last period's buses, but not the ones whose limiters still have
+	// some of them to play out. Those get played this period too.
+	drainCount = 0;
+	mainDraining = false;
 
-		pthread_mutex_unlock(&notemutex);
+	for(unsigned slot = 0; slot < busCount; ++slot)
+	{
+		busSlot[busPort[slot]] = -1;
+
+		Submix* mix = busMix[slot];
+		OutputStage& output = mix ? mix->getOutputStage() : mainOutput;
+		if(!output.isDraining())
+			continue;
+
+		if(mix)
+			draining[drainCount++] = mix;
+		else
+			mainDraining = true;
 	}
 
-	// If we're playing anything, we now have playing notes.
-	if(!playingNotes.empty())
+	busCount = 0;
+
+	// Pick up a newly loaded kit, if there is one.
+	playing = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+	if(!playing)
 	{
-		// Get a list of submixes for each note we're playing
-		int rc = pthread_mutex_lock(&notemutex);
-		SubmixList playingMixes = getSubMixesFor(playingNotes);
-		rc = pthread_mutex_unlock(&notemutex);
+		return;
+	}
+
+	++periods;
+	drainEvents();
 
-		for(SubmixList::iterator e = playingMixes.begin(); e != playingMixes.end(); ++e)
+	// Let the other threads know which kits are still in use: this one,
+	// and any older ones with voices still ringing.
+	unsigned live = playing->number;
+	for(unsigned i = 0; i < voices.size(); ++i)
+	{
+		if((int)(voices.generation[i] - live) < 0)
+			live = voices.generation[i];
+	}
+
+	// A draining submix may belong to a kit that has no voices left, so hold
+	// on to the kits that were live last period until it's done.
+	if(drainCount > 0 && (int)(liveGeneration - live) < 0)
+		live = liveGeneration;
+
+	__atomic_store_n(&liveGeneration, live, __ATOMIC_RELEASE);
+
+	// Jack is asking if we want buffers.
+	// Start every pending voice, so notes that arrived together play together.
+	unsigned active = 0;
+
+	for(unsigned i = 0; i < voices.size(); ++i)
+	{
+		if(voices.isPending(i))
 		{
-			requests.push_back(new BufferRequest((*(e)), (*(e))->getPortNames()));
+			voices.start(i);
 		}
 
-		// Always add requests for the main ports if data is headed there.
-		PortNameList ports;
-		ports.push_back(AudioDriver::LEFT_PORT_NAME);
-		ports.push_back(AudioDriver::RIGHT_PORT_NAME);
-
-		requests.push_back(new BufferRequest(0, ports));
+		++active;
 	}
 
-	return requests;
+	// If we're playing anything (or a bus is still draining), we want buffers.
+	if(active > 0 || drainCount > 0 || mainDraining)
+	{
+		groupVoicesByBus(requests);
+	}
 }
 
-// Return notes destined for the specified Submix.
-// If the specified Submix is null, return notes not destined for any submix.
-// If any of the notes are associated with muted instruments, omit them anyway.
-// If any of the notes are associated with soloed instruments, include ONLY them.
-NoteQueue SDDM::findPlayableNotes(NoteQueue& notes, Submix* mix)
+// Sort this period's playing voices by the bus they mix into, and request
+// buffers for each bus that has any. Submix buses get slots in the order they
+// turn up; the main ports always get the last one. A counting sort, so it's
+// two passes over the voices however many buses there are.
+void SDDM::groupVoicesByBus(BufferRequestList& requests)
 {
-	NoteQueue q;
+	unsigned mainVoices = 0;
 
-	for(NoteQueue::iterator e = notes.begin(); e != notes.end(); ++e)
+	// Count the voices for each bus.
+	for(unsigned i = 0; i < voices.size(); ++i)
 	{
-		Note* note = *e;
+		if(voices.flags[i])
+			continue;
 
-		Instrument * inst = note->getInstrument();
+		// Cut off muted instruments now, before any of the buses are mixed.
+		Instrument* inst = voices.instrument[i];
 		if(inst->isMuted() || inst->isAutoMuted())
 		{
-			note->cancel();
+			voices.cancel(i);
 			continue;
 		}
 
-		if(mix)
+		int port = voices.bus[i];
+		if(port == AudioDriver::LEFT_PORT)
 		{
-			if(inst->getSubmix() == mix)
-			{
-				q.push_back(note);
-			}
+			++mainVoices;
+			continue;
 		}
-		else
+
+		// A submix without ports has nowhere to play, and neither does one that
+		// comes after every slot is taken. Cut those voices off rather than
+		// leave them hanging, never moving on and never finishing.
+		if(port < 0 || (unsigned)port >= AudioDriver::MAX_PORTS)
+		{
+			voices.cancel(i);
+			__atomic_store_n(&unroutedVoices, unroutedVoices + 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		int slot = busSlot[port];
+		if(slot < 0)
 		{
-			if(!inst->isInSubmix())
+			// Leave room for the main ports at the end.
+			if(busCount + 1 >= AudioDriver::MAX_BUFFER_REQUESTS)
 			{
-				q.push_back(note);
+				voices.cancel(i);
+				__atomic_store_n(&unroutedVoices, unroutedVoices + 1, __ATOMIC_RELAXED);
+				continue;
 			}
+
+			Submix* mix = inst->getSubmix();
+
+			slot = (int)busCount++;
+			busSlot[port] = slot;
+			busPort[slot] = port;
+			busMix[slot] = mix;
+			busStart[slot] = 0;
+
+			requests.push_back(BufferRequest(mix, mix->getLeftPort(), mix->getRightPort()));
 		}
+
+		++busStart[slot];
 	}
 
-	return q;
+	// Submixes with nothing playing into them, but a limiter tail to play out.
+	for(unsigned i = 0; i < drainCount; ++i)
+	{
+		Submix* mix = draining[i];
+		int port = mix->getLeftPort();
+		if(port < 0 || (unsigned)port >= AudioDriver::MAX_PORTS || busSlot[port] >= 0)
+			continue;
+
+		if(busCount + 1 >= AudioDriver::MAX_BUFFER_REQUESTS)
+			continue;
+
+		unsigned slot = busCount++;
+		busSlot[port] = (int)slot;
+		busPort[slot] = port;
+		busMix[slot] = mix;
+		busStart[slot] = 0;
+
+		requests.push_back(BufferRequest(mix, mix->getLeftPort(), mix->getRightPort()));
+	}
+
+	// Always add requests for the main ports if data is headed there.
+	unsigned mainSlot = busCount++;
+	busSlot[AudioDriver::LEFT_PORT] = (int)mainSlot;
+	busPort[mainSlot] = AudioDriver::LEFT_PORT;
+	busMix[mainSlot] = 0;
+	busStart[mainSlot] = mainVoices;
+
+	requests.push_back(BufferRequest(0, AudioDriver::LEFT_PORT, AudioDriver::RIGHT_PORT));
+
+	// Turn the counts into where each bus's voices start...
+	unsigned fill[AudioDriver::MAX_BUFFER_REQUESTS];
+	unsigned total = 0;
+
+	for(unsigned slot = 0; slot < busCount; ++slot)
+	{
+		unsigned count = busStart[slot];
+		busStart[slot] = total;
+		fill[slot] = total;
+		total += count;
+	}
+
+	busStart[busCount] = total;
+
+	// ...and drop the voices in.
+	for(unsigned i = 0; i < voices.size(); ++i)
+	{
+		if(voices.flags[i])
+			continue;
+
+		int port = voices.bus[i];
+		if(port < 0 || (unsigned)port >= AudioDriver::MAX_PORTS || busSlot[port] < 0)
+			continue;
+
+		busVoices[fill[busSlot[port]]++] = i;
+	}
 }
 
-void SDDM::play(BufferResponse* response)
+/** Mix "count" frames out of "length" frames of sample data at fixed gains,
+	starting at "pos", and move "pos" along.
+	*/
+static void mixFrom(
+	const float* sampleL, const float* sampleR, unsigned length
+, SamplePosition& pos, SamplePosition step, unsigned char interpolation
+, float* left, float* right, unsigned count
+, float gainL, float gainR
+, float& peakL, float& peakR)
 {
-	if(!playingNotes.empty())
+	// Unpitched voices walk the sample one frame at a time, so they can
+	// go straight to the vectorized kernels.
+	if(step == POSITION_ONE)
 	{
-		unsigned frames = response->getFrames();
+		unsigned idx = (unsigned)(pos >> POSITION_FRACTION_BITS);
+		Mixer::mix(left, right, sampleL + idx, sampleR + idx, count, gainL, gainR, peakL, peakR);
+		pos += (SamplePosition)count << POSITION_FRACTION_BITS;
+		return;
+	}
 
-		// Find the submix whose ports we're supposed to populate.
-		Submix* mix = (Submix*)response->getRequest()->getData();
-		NoteQueue notes = findPlayableNotes(playingNotes, mix);
+	// Pitched voices read between frames, the way the instrument asked for.
+	switch(interpolation)
+	{
+		case Instrument::LINEAR:
+			resample<LinearInterpolator>(sampleL, sampleR, length, left, right, count, pos, step, gainL, gainR, peakL, peakR);
+			break;
+
+		case Instrument::SINC:
+			resample<SincInterpolator>(sampleL, sampleR, length, left, right, count, pos, step, gainL, gainR, peakL, peakR);
+			break;
+
+		default:
+			resample<CubicInterpolator>(sampleL, sampleR, length, left, right, count, pos, step, gainL, gainR, peakL, peakR);
+			break;
+	}
+}
+
+/** Mix "count" frames of a voice at fixed gains, starting at its current
+	position, and move the position along.
+	*/
+static void mixRun(
+	VoicePool& voices, unsigned v, DiskStreamer& streamer
+, float* left, float* right, unsigned count
+, float gainL, float gainR
+, float& peakL, float& peakR)
+{
+	SamplePosition pos = voices.position[v];
+	SamplePosition step = voices.step[v];
+
+	// Nothing to hear (a level of 0, or panned all the way off), so just move along.
+	if(gainL == 0.0f && gainR == 0.0f)
+	{
+		voices.position[v] = pos + step * count;
+		return;
+	}
+
+	int stream = voices.stream[v];
+	if(stream < 0)
+	{
+		mixFrom(voices.dataL[v], voices.dataR[v], voices.frames[v], pos, step, voices.interpolation[v],
+			left, right, count, gainL, gainR, peakL, peakR);
+		voices.position[v] = pos;
+		return;
+	}
+
+	// A streamed voice plays from memory up to the seam...
+	unsigned done = 0;
+	SamplePosition seam = (SamplePosition)DiskStreamer::seamFor(voices.resident[v]) << POSITION_FRACTION_BITS;
+
+	if(pos < seam)
+	{
+		done = count;
+		if(step > 0 && (seam - pos + step - 1) / step < count)
+			done = (unsigned)((seam - pos + step - 1) / step);
+
+		mixFrom(voices.dataL[v], voices.dataR[v], voices.resident[v], pos, step, voices.interpolation[v],
+			left, right, done, gainL, gainR, peakL, peakR);
+	}
+
+	// ...and from its stream after that, a window of it at a time. Each window
+	// starts TAPS frames before the position, so the interpolators see the same
+	// neighbouring frames they would if the whole sample were in memory.
+	unsigned length = voices.frames[v];
+	const SamplePosition widest = (SamplePosition)(DiskStreamer::MIRROR_FRAMES - 2 * DiskStreamer::TAPS - 2) << POSITION_FRACTION_BITS;
 
-		float kitLevelL = (float)kit->getLevel();
-		if(kitLevelL <= 0)
+	while(done < count)
+	{
+		unsigned run = count - done;
+		if(step > 0 && widest / step + 1 < run)
+			run = (unsigned)(widest / step + 1);
+
+		unsigned first = (unsigned)(pos >> POSITION_FRACTION_BITS) - DiskStreamer::TAPS;
+		unsigned last = (unsigned)((pos + step * (run - 1)) >> POSITION_FRACTION_BITS) + DiskStreamer::TAPS + 1;
+		if(last > length)
+			last = length;
+
+		const float *windowL, *windowR;
+		SamplePosition origin = (SamplePosition)first << POSITION_FRACTION_BITS;
+
+		if(streamer.read(stream, first, last - first, windowL, windowR))
+		{
+			SamplePosition offset = pos - origin;
+			mixFrom(windowL, windowR, last - first, offset, step, voices.interpolation[v],
+				left + done, right + done, run, gainL, gainR, peakL, peakR);
+			pos = origin + offset;
+		}
+		else
 		{
-			kitLevelL = 100;
+			// The I/O thread is behind. Play silence, but keep time.
+			pos += step * run;
 		}
 
-		kitLevelL /= 100;
+		done += run;
+	}
+
+	voices.position[v] = pos;
+}
+
+// A fading voice is mixed in runs this long, each at the fade's level halfway through it.
+static const unsigned FADE_RUN = 8;
+
+/** Mix one voice into a stereo buffer.
+	Renders up to "frames" frames of the voice's sample, starting at its current
+	position, and returns the number of frames actually rendered. Anything less
+	than "frames" means the voice ran off the end of its sample, or finished
+	fading out.
+	*/
+static unsigned mixVoice(
+	VoicePool& voices, unsigned v, DiskStreamer& streamer
+, float* left, float* right, unsigned frames
+, unsigned sampleEndGap
+, float& peakL, float& peakR)
+{
+	// The voice is done once fewer than sampleEndGap frames remain after the
+	// current position, so work out how many frames we get this time around.
+	unsigned length = voices.frames[v];
+	if(length <= 1 + sampleEndGap)
+		return 0;
+
+	SamplePosition end = (SamplePosition)(length - 1 - sampleEndGap) << POSITION_FRACTION_BITS;
+	SamplePosition pos = voices.position[v];
+	SamplePosition step = voices.step[v];
 
-		float kitLevelR = kitLevelL;
+	if(pos >= end)
+		return 0;
+
+	unsigned count = frames;
+	if(step > 0)
+	{
+		SamplePosition remaining = (end - pos + step - 1) / step;
+		if(remaining < frames)
+			count = (unsigned)remaining;
+	}
+
+	if(!voices.isReleasing(v))
+	{
+		mixRun(voices, v, streamer, left, right, count, voices.gainL[v], voices.gainR[v], peakL, peakR);
+		return count;
+	}
+
+	// Fading out: short runs, each a little quieter than the last, until it's silent.
+	float fade = voices.fade[v];
+	float fadeStep = voices.fadeStep[v];
+	unsigned done = 0;
+
+	while(done < count && fade > 0.0f)
+	{
+		unsigned run = count - done;
+		if(run > FADE_RUN)
+			run = FADE_RUN;
+
+		float gain = fade - fadeStep * run * 0.5f;
+		if(gain < 0.0f)
+			gain = 0.0f;
+
+		mixRun(voices, v, streamer, left + done, right + done, run, voices.gainL[v] * gain, voices.gainR[v] * gain, peakL, peakR);
+
+		fade -= fadeStep * run;
+		done += run;
+	}
+
+	voices.fade[v] = fade;
+	return done;
+}
+
+void SDDM::play(BufferResponse* response)
+{
+	// A bus can have no voices left and still be draining its limiter.
+	if(busCount > 0)
+	{
+		unsigned frames = response->getFrames();
 
 		// Assign pointers to the left/right buffers in the response.
 		float* left = response->getLeft();
 		float* right = response->getRight();
 
-		for(unsigned i = 0; i < frames; ++i)
+		if(!left || !right)
 		{
-			// Point at the current spot in the buffer.
-			float *dataL = (left+i);
-			float *dataR = (right+i);
+			return;
+		}
 
-			for(NoteQueue::iterator e = notes.begin(); e != notes.end(); ++e)
-			{
-				Note *n = (*(e));
+		// Find the submix whose ports we're supposed to populate,
+		// and the voices getBufferRequests lined up for it.
+		Submix* mix = (Submix*)response->getRequest()->getData();
+		PortHandle port = response->getRequest()->getLeftPort();
 
-				if(n->isCancelled())
-					continue;
+		int slot = (port >= 0 && (unsigned)port < AudioDriver::MAX_PORTS) ? busSlot[port] : -1;
+		if(slot < 0)
+		{
+			return;
+		}
 
-				float volumeL = (float)n->getInstrument()->getLevel();
-				float volumeR = volumeL;
+		const unsigned* mixList = busVoices + busStart[slot];
+		unsigned count = busStart[slot + 1] - busStart[slot];
 
-				short pan = n->getInstrument()->getPan();
+		float kitLevel = (float)playing->kit->getLevel();
+		if(kitLevel <= 0)
+		{
+			kitLevel = 100;
+		}
 
-				/*
-				pan can have a value from -100 (full left) to 100 (full right).
+		kitLevel /= 100;
 
-				subtract (pan) from left Volume to derive its volume.
-				add (pan) to right to get its volume.
-				*/
-				volumeL -= pan;
-				volumeR += pan;
+		// Everything about a voice that stays put for the whole period
+		// (gains, pitch step) is worked out once, up front.
+		for(unsigned i = 0; i < count; ++i)
+		{
+			unsigned v = mixList[i];
+			Instrument* inst = voices.instrument[v];
 
-				volumeL /= 100;
-				volumeR /= 100;
+			float volumeL = (float)inst->getLevel();
+			float volumeR = volumeL;
 
-				volumeL *= kitLevelL;
-				volumeR *= kitLevelR;
+			/*
+			pan can have a value from -100 (full left) to 100 (full right).
 
-				const Sample *sample = n->getSample();
+			subtract (pan) from left Volume to derive its volume.
+			add (pan) to right to get its volume.
+			*/
+			short pan = inst->getPan();
+			volumeL -= pan;
+			volumeR += pan;
 
-				if(sample->frames - (n->samplePosition+1) <= sampleEndGap)
-				{
-					n->finish();
-					break;
-				}
+			voices.gainL[v] = (volumeL / 100) * kitLevel * voices.level[v];
+			voices.gainR[v] = (volumeR / 100) * kitLevel * voices.level[v];
 
-				float* sampleL = (sample->dataL + (unsigned)n->samplePosition);
-				float* sampleR = (sample->dataR + (unsigned)n->samplePosition);
+			/*
+			"Jack" with the pitch (har har).
 
-				/*
-				"Jack" with the pitch (har har).
+			If the instrument's pitch is higher than the default, step through the sample faster.
+			If lower, step through slower. This is basically the same as up- or down-sampling.
+			*/
+			double ratio = 1.0 + ((double)inst->getPitch() / 100);
+			if(ratio < MIN_PITCH_RATIO)
+				ratio = MIN_PITCH_RATIO;
 
-				If the instrument's pitch is higher than the default, step through the sample faster.
-				If lower, step through slower. This is basically the same as up- or down-sampling.
-				*/
-				float step = 1.0f + (((float)n->getInstrument()->getPitch()) / 100);
+			voices.step[v] = (SamplePosition)(ratio * POSITION_ONE + 0.5);
+		}
 
-				float instLSum = 0.0f, instRSum = 0.0f;
+		// Then each voice is mixed into the buffer in one contiguous run.
+		for(unsigned i = 0; i < count; ++i)
+		{
+			unsigned v = mixList[i];
+			Instrument* inst = voices.instrument[v];
 
-				// Now is the time on Sprockets when we mix!
-				if(dataL && sampleL)
-				{
-					instLSum = (*sampleL * volumeL);
-					float sum = (*dataL + (*sampleL * volumeL));
-					if(fabs(sum) < LIMIT)
-						*dataL = sum;
-				}
+			// A voice that starts partway into the period only plays the rest of it.
+			unsigned offset = voices.offset[v];
+			if(offset >= frames)
+			{
+				voices.offset[v] = offset - frames;
+				continue;
+			}
 
-				if(dataR && sampleR)
-				{
-					instRSum = (*sampleR * volumeR);
-					float sum = (*dataR + (*sampleR * volumeR));
-					if(fabs(sum) < LIMIT)
-						*dataR = sum;
-				}
+			voices.offset[v] = 0;
 
-				// This works for a "master" fader, but not for individual instruments.
-// 				n->getInstrument()->setVolumes(fabs(*dataL)*100, fabs(*dataR)*100);
+			float peakL = 0.0f, peakR = 0.0f;
+			unsigned rendered = mixVoice(voices, v, streamer, left + offset, right + offset, frames - offset, sampleEndGap, peakL, peakR);
 
-				// Only set the volumes on the instrument if this volume is higher than
-				// the current one. 
-				// (Without this, previously-played notes (which appear later in the notes queue)
-				// override the higher values of the most-recently played notes, resulting in "backwards"
-				// readings on VU meters, etc.
-				instLSum = fabs(instLSum * 100);
-				instRSum = fabs(instRSum * 100);
+			// The stream can fill in over what the voice has gone past.
+			if(voices.stream[v] >= 0)
+				streamer.release(voices.stream[v], (unsigned)(voices.position[v] >> POSITION_FRACTION_BITS));
 
-				if(instLSum >= n->getInstrument()->getVolumeL())
-					n->getInstrument()->setVolumeL(instLSum);
+			voices.loudness[v] = (peakL > peakR) ? peakL : peakR;
 
-				if(instRSum >= n->getInstrument()->getVolumeR())
-					n->getInstrument()->setVolumeR(instRSum);
+			// Only set the volumes on the instrument if this volume is higher than
+			// the current one.
+			// (Without this, voices of the same instrument override each other's
+			// levels, resulting in "backwards" readings on VU meters, etc.
+			peakL *= 100;
+			peakR *= 100;
 
-				n->samplePosition += step;
-			} // for (notes...)
-		} // for (frames...)
+			if(peakL >= inst->getVolumeL())
+				inst->setVolumeL(peakL);
 
-		pthread_mutex_lock(&notemutex);
+			if(peakR >= inst->getVolumeR())
+				inst->setVolumeR(peakR);
 
-		for(unsigned i = 0; i < playingNotes.size(); ++i)
-		{
-			Note* n = playingNotes[i];
-			if(n->isFinished())
-			{
-				playingNotes.erase(playingNotes.begin() + i);
-				availableNotes.push_front(n);
-			}
+			if(rendered < frames - offset)
+				voices.finish(v);
 		}
 
-		for(NoteQueueListenerList::iterator e = noteQueueListeners.begin(); e != noteQueueListeners.end(); ++e)
-		{
-			(*(e))->noteQueueUpdate(&playingNotes);
-	  }
+		// The bus is mixed; now keep it in bounds, once for the whole period.
+		OutputStage& output = mix ? mix->getOutputStage() : mainOutput;
+		output.setLimiter(playing->kit->hasLimiter(), audioDriver->getSampleRate());
+		output.process(left, right, frames, periods);
+	}
+}
+
+void SDDM::playDone()
+{
+	if(voices.empty())
+		return;
+
+	// Drop finished voices. Removing moves the last voice into slot i,
+	// so look at slot i again.
+	for(unsigned i = 0; i < voices.size(); )
+	{
+		if(voices.isFinished(i))
+			removeVoice(i);
+		else
+			++i;
+	}
 
-		pthread_mutex_unlock(&notemutex);
+	// Now the streams can be topped up for next time.
+	if(streamer.isRunning())
+		streamer.wake();
+
+	for(VoicePoolListenerList::iterator e = voicePoolListeners.begin(); e != voicePoolListeners.end(); ++e)
+	{
+		(*(e))->voicePoolUpdate(&voices);
 	}
 }
 
-// Remove all notes for the instruments in the specified list.
-void SDDM::cancelNotesFor(InstrumentList& victims, NoteQueue& notes)
+// Fade out every voice in any of the choke groups, each at its own instrument's release rate.
+void SDDM::chokeVoices(uint32_t groups)
 {
-	// TODO: This could be faster. See if there's a way to put victims 
-	// in a map of some kind so lookups happen faster.
-	for(InstrumentList::iterator e = victims.begin(); e != victims.end(); ++e)
+	float rate = (float)audioDriver->getSampleRate();
+
+	for(unsigned i = 0; i < voices.size(); ++i)
 	{
-		for(NoteQueue::iterator f = notes.begin(); f != notes.end(); ++f)
-		{
-			Note *n = (*(f));
-			if(n->getInstrument() == (*(e)))
-			{
-				n->cancel();
-			}
-		}
+		if(!(voices.chokeGroup[i] & groups) || voices.isFinished(i))
+			continue;
+
+		unsigned release = voices.instrument[i]->getRelease();
+
+		if(release == 0)
+			voices.cancel(i);
+		else
+			voices.release(i, 1000.0f / (release * rate));
 	}
 }
 
@@ -0,0 +1,181 @@
+// voice.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+using namespace std;
+
+#include "voice.h"
+
+VoicePool::VoicePool(unsigned capacity)
+: capacity(capacity)
+, count(0)
+, nextSerial(0)
+{
+	position = new SamplePosition[capacity];
+	step = new SamplePosition[capacity];
+	gainL = new float[capacity];
+	gainR = new float[capacity];
+	level = new float[capacity];
+	dataL = new const float*[capacity];
+	dataR = new const float*[capacity];
+	frames = new unsigned[capacity];
+	resident = new unsigned[capacity];
+	stream = new int[capacity];
+	instrument = new Instrument*[capacity];
+	velocity = new unsigned char[capacity];
+	number = new unsigned char[capacity];
+	flags = new unsigned char[capacity];
+	interpolation = new unsigned char[capacity];
+	serial = new unsigned[capacity];
+	offset = new unsigned[capacity];
+	generation = new unsigned[capacity];
+	bus = new int[capacity];
+	fade = new float[capacity];
+	fadeStep = new float[capacity];
+	loudness = new float[capacity];
+	chokeGroup = new uint32_t[capacity];
+}
+
+VoicePool::~VoicePool()
+{
+	delete[] position;
+	delete[] step;
+	delete[] gainL;
+	delete[] gainR;
+	delete[] level;
+	delete[] dataL;
+	delete[] dataR;
+	delete[] frames;
+	delete[] resident;
+	delete[] stream;
+	delete[] instrument;
+	delete[] velocity;
+	delete[] number;
+	delete[] flags;
+	delete[] interpolation;
+	delete[] serial;
+	delete[] offset;
+	delete[] generation;
+	delete[] bus;
+	delete[] fade;
+	delete[] fadeStep;
+	delete[] loudness;
+	delete[] chokeGroup;
+}
+
+int VoicePool::add(Instrument * inst, const Sample * sample, unsigned velo, unsigned num)
+{
+	if(count == capacity)
+		return -1;
+
+	unsigned i = count;
+
+	position[i] = 0;
+	step[i] = POSITION_ONE;
+	gainL[i] = 0.0f;
+	gainR[i] = 0.0f;
+	level[i] = 1.0f;
+	dataL[i] = sample->dataL;
+	dataR[i] = sample->dataR;
+	frames[i] = sample->frames;
+	resident[i] = sample->frames;
+	stream[i] = -1;
+	instrument[i] = inst;
+	velocity[i] = (unsigned char)velo;
+	number[i] = (unsigned char)num;
+	flags[i] = PENDING;
+	interpolation[i] = Instrument::CUBIC;
+	serial[i] = nextSerial++;
+	offset[i] = 0;
+	generation[i] = 0;
+	bus[i] = 0;
+	fade[i] = 1.0f;
+	fadeStep[i] = 0.0f;
+	loudness[i] = 1.0f;
+	chokeGroup[i] = inst->getChokeGroup();
+
+	++count;
+	return (int)i;
+}
+
+void VoicePool::remove(unsigned i)
+{
+	unsigned last = count - 1;
+
+	if(i != last)
+	{
+		position[i] = position[last];
+		step[i] = step[last];
+		gainL[i] = gainL[last];
+		gainR[i] = gainR[last];
+		level[i] = level[last];
+		dataL[i] = dataL[last];
+		dataR[i] = dataR[last];
+		frames[i] = frames[last];
+		resident[i] = resident[last];
+		stream[i] = stream[last];
+		instrument[i] = instrument[last];
+		velocity[i] = velocity[last];
+		number[i] = number[last];
+		flags[i] = flags[last];
+		interpolation[i] = interpolation[last];
+		serial[i] = serial[last];
+		offset[i] = offset[last];
+		generation[i] = generation[last];
+		bus[i] = bus[last];
+		fade[i] = fade[last];
+		fadeStep[i] = fadeStep[last];
+		loudness[i] = loudness[last];
+		chokeGroup[i] = chokeGroup[last];
+	}
+
+	count = last;
+}
+
+int VoicePool::findOldest() const
+{
+	int oldest = -1;
+
+	// Compare serials by difference so this still works when they wrap.
+	for(unsigned i = 0; i < count; ++i)
+	{
+		if(oldest == -1 || (int)(serial[i] - serial[oldest]) < 0)
+			oldest = (int)i;
+	}
+
+	return oldest;
+}
+
+void VoicePool::finish(unsigned i)
+{
+	flags[i] |= FINISHED;
+	instrument[i]->setVolumes(0, 0);
+}
+
+void VoicePool::cancel(unsigned i)
+{
+	finish(i);
+	flags[i] |= CANCELLED;
+}
+
+void VoicePool::release(unsigned i, float s)
+{
+	if(s > fadeStep[i])
+		fadeStep[i] = s;
+}
@@ -0,0 +1,163 @@
+// worker.cpp
+/*
+ *  Copyright (c) 2008, 2013 Kelly Schrock, John Hammen
+ *
+ *  This file is part of SDDM.
+ *
+ *  SDDM is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SDDM is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SDDM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <iostream>
+
+using namespace std;
+
+#include "worker.h"
+#include "rtcheck.h"
+
+// Semaphore waits can be interrupted by signals; just go back to waiting.
+static void waitFor(sem_t *sem)
+{
+	while(sem_wait(sem) != 0 && errno == EINTR)
+		;
+}
+
+WorkerPool::WorkerPool()
+: client(0)
+, threadCount(0)
+, job(0)
+, jobCount(0)
+, next(0)
+, quit(false)
+{
+	sem_init(&wake, 0, 0);
+	sem_init(&done, 0, 0);
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+
+	sem_destroy(&wake);
+	sem_destroy(&done);
+}
+
+bool WorkerPool::start(jack_client_t *c, unsigned count)
+{
+	stop();
+
+	client = c;
+	quit = false;
+
+	if(count > MAX_THREADS)
+		count = MAX_THREADS;
+
+	int priority = jack_client_real_time_priority(client);
+	bool realtime = (priority >= 0);
+
+	for(unsigned i = 0; i < count; ++i)
+	{
+		if(jack_client_create_thread(client, &threads[threadCount], priority, realtime, threadMain, this))
+		{
+			cerr << "Unable to start render thread " << i << endl;
+			break;
+		}
+
+		++threadCount;
+	}
+
+	cout << "render threads: " << threadCount << (realtime ? " (real-time)" : "") << endl;
+
+	return threadCount == count;
+}
+
+void WorkerPool::stop()
+{
+	if(threadCount == 0)
+		return;
+
+	__atomic_store_n(&quit, true, __ATOMIC_RELEASE);
+
+	for(unsigned i = 0; i < threadCount; ++i)
+		sem_post(&wake);
+
+	for(unsigned i = 0; i < threadCount; ++i)
+		jack_client_stop_thread(client, threads[i]);
+
+	threadCount = 0;
+}
+
+void WorkerPool::run(IParallelJob &j, unsigned count)
+{
+	// Not worth waking anybody up for.
+	if(threadCount == 0 || count < 2)
+	{
+		for(unsigned i = 0; i < count; ++i)
+			j.run(i);
+
+		return;
+	}
+
+	job = &j;
+	jobCount = count;
+	__atomic_store_n(&next, 0, __ATOMIC_RELAXED);
+
+	// We take pieces too, so there's no point waking more helpers than there
+	// are pieces left over for them. (sem_post publishes job and jobCount.)
+	unsigned helpers = count - 1;
+	if(helpers > threadCount)
+		helpers = threadCount;
+
+	for(unsigned i = 0; i < helpers; ++i)
+		sem_post(&wake);
+
+	work();
+
+	for(unsigned i = 0; i < helpers; ++i)
+		waitFor(&done);
+}
+
+void WorkerPool::work()
+{
+	for(;;)
+	{
+		unsigned i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+		if(i >= jobCount)
+			break;
+
+		job->run(i);
+	}
+}
+
+void* WorkerPool::threadMain(void *arg)
+{
+	WorkerPool *pool = (WorkerPool*)arg;
+
+	for(;;)
+	{
+		waitFor(&pool->wake);
+
+		if(__atomic_load_n(&pool->quit, __ATOMIC_ACQUIRE))
+			break;
+
+		// Helpers are held to the same rules as the process thread.
+		RT_ENTER();
+		pool->work();
+		RT_LEAVE();
+
+		sem_post(&pool->done);
+	}
+
+	return 0;
+}